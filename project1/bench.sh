@@ -0,0 +1,27 @@
+#!/bin/sh
+# Build every benchmark and run it on a virtual display, so no framebuffer
+# (or root) is needed.  The driver benchmark is built with GRAPHICS_STATS and
+# saves its last frame as a PPM for comparing against a golden image.
+# Usage: ./bench.sh [WIDTHxHEIGHTxBITS]    (default 1024x768x16)
+
+set -e
+cd "$(dirname "$0")"
+
+display=${1:-1024x768x16}
+out=_bench
+cflags="-O2 -pthread ${CFLAGS:-}"
+
+mkdir -p $out
+for bench in text_bench tile_bench shape_bench blend_bench sprite_bench; do
+	gcc $cflags -o $out/$bench $bench.c
+done
+gcc $cflags -DGRAPHICS_STATS -o $out/driver driver.c
+
+for bench in text_bench tile_bench shape_bench blend_bench sprite_bench; do
+	echo "== $bench"
+	GRAPHICS_VIRTUAL=$display ./$out/$bench
+done
+
+echo "== driver bench"
+GRAPHICS_VIRTUAL=$display ./$out/driver bench $out/driver_bench.ppm
+echo "last frame saved to $out/driver_bench.ppm"
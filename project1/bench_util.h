@@ -0,0 +1,33 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include "library.c"
+
+#include <stdio.h>
+
+//Helpers shared by the *_bench.c programs.  Each benchmark takes one
+//optional argument, how much work to do, and draws on whatever display
+//init_graphics() opens (set GRAPHICS_VIRTUAL to run without a framebuffer).
+
+//Seconds elapsed on the monotonic clock since start
+double seconds_since(const struct timespec* start){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+//Open the display and return the amount of work asked for on the command line, or default_count
+long bench_setup(int argc, char** argv, long default_count){
+	long count = default_count;
+
+	if(argc > 1){
+		count = strtol(argv[1], NULL, 10);
+	}
+
+	init_graphics();
+
+	return count;
+}
+
+#endif
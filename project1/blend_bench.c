@@ -0,0 +1,70 @@
+#include "bench_util.h"
+
+//Blending benchmark: blends a translucent panel over the whole screen, a
+//full-screen coverage mask, and screens full of anti-aliased text, and
+//reports Mpixels per second for each (text counts every pixel of every
+//glyph cell).  Build with -msse2 (the default on x86-64) or -mavx2 to pick
+//the kernel being measured.
+//Usage: ./blend_bench [repetitions]
+
+int main(int argc, char** argv){
+	int repetitions = 0;
+	char line[256];
+	struct timespec start;
+	double rect_seconds = 0;
+	double mask_seconds = 0;
+	double text_seconds = 0;
+	int i = 0;
+	int x = 0;
+	int y = 0;
+
+	repetitions = bench_setup(argc, argv, 100);
+
+	int width = screen_var_info.xres;
+	int height = screen_var_info.yres;
+	int columns = width / GLYPH_WIDTH < (int) sizeof(line) ? width / GLYPH_WIDTH : (int) sizeof(line) - 1;
+	unsigned char* mask = malloc(width * height);
+
+	for(y = 0; y < height; y++){ //A diagonal gradient, so every coverage value shows up
+		for(x = 0; x < width; x++){
+			mask[y*width + x] = (x + y) & 0xff;
+		}
+	}
+	for(i = 0; i < columns; i++){
+		line[i] = ' ' + (i % 95);
+	}
+	line[columns] = '\0';
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < repetitions; i++){
+		blend_rect(0, 0, width, height, MAKE_COLOR(0, 0, 31), 96 + i % 64);
+	}
+	rect_seconds = seconds_since(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < repetitions; i++){
+		blend_mask(0, 0, width, height, mask, width, MAKE_COLOR(31, i % 64, 0), 255);
+	}
+	mask_seconds = seconds_since(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < repetitions; i++){
+		for(y = 0; y + GLYPH_HEIGHT <= height; y += GLYPH_HEIGHT){
+			draw_text_aa(0, y, line, MAKE_COLOR(31, 63, 31), 160 + i % 96);
+		}
+	}
+	text_seconds = seconds_since(&start);
+
+	exit_graphics();
+	free(mask);
+
+	double pixels = (double) width * height * repetitions;
+	double text_pixels = (double) columns * GLYPH_WIDTH * (height / GLYPH_HEIGHT * GLYPH_HEIGHT) * repetitions;
+
+	printf("%dx%d, %d bpp, %d repetitions\n", width, height, screen_var_info.bits_per_pixel, repetitions);
+	printf("constant alpha:   %8.1f Mpixels/s\n", pixels / rect_seconds / 1e6);
+	printf("coverage mask:    %8.1f Mpixels/s\n", pixels / mask_seconds / 1e6);
+	printf("anti-aliased text:%8.1f Mpixels/s\n", text_pixels / text_seconds / 1e6);
+
+	return 0;
+}
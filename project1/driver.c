@@ -1,6 +1,93 @@
 #include "library.c"
 
-int main(){
+#include <stdio.h>
+
+#define BENCH_FRAMES 300
+
+//Benchmark mode: draws a busy double-buffered frame BENCH_FRAMES times and prints what it cost.
+//Build with -DGRAPHICS_STATS to get the counters; without it only the frame rate is known.
+//If ppm_path is not NULL, the last frame is saved there for comparing against a golden image.
+void run_benchmark(const char* ppm_path){
+	int triangle[6] = {0, 0, 0, 0, 0, 0};
+	struct timespec start, end;
+	const char* wanted_ppm = ppm_path;
+	char line[64];
+	int frame = 0;
+	int i = 0;
+
+	init_graphics();
+	enable_double_buffer();
+
+	int width = screen_var_info.xres;
+	int height = screen_var_info.yres;
+
+#ifdef GRAPHICS_STATS
+	reset_graphics_stats();
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(frame = 0; frame < BENCH_FRAMES; frame++){
+		fill_rect(0, 0, width, height, MAKE_COLOR(0, 0, 6)); //background
+
+		for(i = 0; i < 20; i++){ //rectangles and lines, some hanging off the edges
+			draw_rect((i * 97 + frame) % width - 40, (i * 61) % height - 20, 120, 80, MAKE_COLOR(i, (63 - i), 10));
+			draw_line(i * width / 20, 0, width - 1 - i * width / 20 + frame % 50, height - 1, MAKE_COLOR(31, 2 * i, 0));
+		}
+
+		fill_circle(width / 2, height / 2, 60 + frame % 40, MAKE_COLOR(5, 40, 20)); //circles
+		draw_circle(width / 3, height / 3, 90, MAKE_COLOR(31, 63, 0));
+
+		triangle[0] = frame % width; //a triangle sweeping across
+		triangle[1] = 40;
+		triangle[2] = triangle[0] + 150;
+		triangle[3] = height - 40;
+		triangle[4] = triangle[0] - 150;
+		triangle[5] = height - 40;
+		fill_polygon(triangle, 3, MAKE_COLOR(20, 10, 31));
+
+		blend_rect(0, height - 64, width, 64, MAKE_COLOR(0, 0, 0), 160); //translucent status bar
+		snprintf(line, sizeof(line), "frame %d", frame);
+		draw_text_aa(8, height - 40, line, MAKE_COLOR(31, 63, 31), 255);
+		draw_text(8, height - 20, "benchmark mode", MAKE_COLOR(31, 63, 0));
+
+		present();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if(ppm_path && dump_ppm(ppm_path) < 0){
+		ppm_path = NULL; //Reported below, once the terminal is back to normal
+	}
+
+	exit_graphics(); //With GRAPHICS_STATS this also prints the per-primitive table to stderr
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d frames in %.3f s: %.1f fps\n", BENCH_FRAMES, seconds, BENCH_FRAMES / seconds);
+	if(!ppm_path && wanted_ppm){
+		printf("could not save the last frame\n");
+	}
+
+#ifdef GRAPHICS_STATS
+	const struct graphics_stats* stats = graphics_stats();
+	unsigned long long primitives = 0;
+
+	for(i = 0; i < NUM_PRIMITIVE_KINDS; i++){
+		primitives += stats->primitives[i];
+	}
+	printf("%.1f Mpixels written/s, %.1f MB flushed/s, %.0f primitives/s, %.0f pixels clipped per frame\n",
+		stats->pixels_written / seconds / 1e6,
+		stats->bytes_flushed / seconds / 1e6,
+		primitives / seconds,
+		(double) stats->pixels_clipped / BENCH_FRAMES);
+#else
+	printf("rebuild with -DGRAPHICS_STATS for pixel, primitive and flush counters\n");
+#endif
+}
+
+int main(int argc, char** argv){
+	if(argc > 1 && strcmp(argv[1], "bench") == 0){ //./driver bench [last_frame.ppm]
+		run_benchmark(argc > 2 ? argv[2] : NULL);
+		return 0;
+	}
+
 	//Initialize the graphics library
 	init_graphics();
 
@@ -1,80 +1,287 @@
+#define _GNU_SOURCE //For ppoll() and memfd_create()
+
 #include "iso_font.h" //Apple's supplied font
 
 #include <unistd.h> //Contains STDIN and STDOUT constants
 #include <fcntl.h>
 #include <termios.h>
+#include <stdint.h> //Fixed-width integers for the wide span stores
+#include <stdlib.h> //posix_memalign() and free() for the back buffer
+#include <string.h>
+#include <stdio.h> //snprintf() for PPM headers and the stats table
+#include <time.h>
+#include <errno.h>
+#include <pthread.h> //Worker threads for tiled rendering
+#include <poll.h>
+#include <sys/uio.h> //readv() fills both halves of the key ring buffer in one call
 
 #include <linux/fb.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h> //fstat() for loading sprites
+
+#ifdef __SSE2__
+#include <emmintrin.h> //128-bit stores for long spans when the compiler targets SSE2
+#endif
+#ifdef __AVX2__
+#include <immintrin.h> //256-bit blending when the compiler targets AVX2
+#endif
 
 #define MAKE_COLOR(r, g, b) ((color_t) (r << 11) | (g << 5) | (b))
 
 typedef unsigned short color_t;
+typedef uint64_t __attribute__((__may_alias__)) wide_pixels_t; //4 pixels written with a single 64-bit store
 
-int framebuffer_desc; //The framebuffer device file descriptor
-color_t* framebuffer; //The actual address of the framebuffer in memory
+int framebuffer_desc; //The framebuffer device file descriptor, or the file or memfd behind a virtual display
+int virtual_display; //Set when drawing into a surface in memory instead of /dev/fb0
+unsigned char* framebuffer; //The actual address of the framebuffer in memory
+unsigned char* display_origin; //Address of the top-left visible pixel within the framebuffer; moves when the display is panned
+int can_pan; //Set if the driver can pan the display vertically through yres_virtual
+int original_yoffset; //Where the display was panned to before init_graphics; exit_graphics pans it back
+unsigned char* back_buffer; //Heap copy of the display that is drawn into when double buffering is enabled; NULL otherwise
+unsigned char* draw_buffer; //Where the drawing functions write: display_origin, or the back buffer
 int size_of_display; //Size of the display's space when mapping the framebuffer to our address space
+int stride; //Bytes from the start of one row of the display to the next, padding included
 struct termios terminal_settings; //Settings of the terminal; mostly ICANON and ECHO will be used
+int stdin_flags; //File status flags of stdin before init_graphics made it non-blocking
 struct fb_var_screeninfo screen_var_info;
 struct fb_fix_screeninfo screen_fix_info;
 
 void clear_screen();
+void disable_double_buffer();
+int set_raster_threads(int count);
+static void select_pixel_format();
+static inline unsigned char* pixel_address(unsigned char* buffer, int x, int y);
+static void start_graphics();
+int init_graphics_virtual(int width, int height, int bits_per_pixel, const char* path);
+#ifdef GRAPHICS_STATS
+void dump_graphics_stats(int fd);
+#endif
 
+//Set up the display: /dev/fb0, or a virtual display if GRAPHICS_VIRTUAL is set (see init_graphics_virtual)
 void init_graphics(){
+	const char* spec = getenv("GRAPHICS_VIRTUAL"); //WIDTHxHEIGHTxBITS, optionally followed by :PATH
+	char* end = NULL;
+
+	if(spec){
+		long width = strtol(spec, &end, 10);
+		long height = *end == 'x' ? strtol(end + 1, &end, 10) : 0;
+		long bits = *end == 'x' ? strtol(end + 1, &end, 10) : 0;
+
+		if((*end == '\0' || *end == ':') && init_graphics_virtual(width, height, bits, *end == ':' ? end + 1 : NULL) == 0){
+			return;
+		}
+	}
+
 	framebuffer_desc = open("/dev/fb0", O_RDWR); //Open the framebuffer and get the file descriptor
 
 	ioctl(framebuffer_desc, FBIOGET_VSCREENINFO, &screen_var_info);
 	ioctl(framebuffer_desc, FBIOGET_FSCREENINFO, &screen_fix_info);
+	start_graphics();
+}
+
+//Everything after the display's screen info is known, shared by both kinds of display
+static void start_graphics(){
+	select_pixel_format(); //Pick the span writers that match the framebuffer's depth and layout
 
 	ioctl(STDIN_FILENO, TCGETS, &terminal_settings); //Get the current terminal settings
 	terminal_settings.c_lflag &= ~ICANON; //Switch ICANON off
 	terminal_settings.c_lflag &= ~ECHO; //Switch ECHO off
 	ioctl(STDIN_FILENO, TCSETS, &terminal_settings); //Set the new terminal settings
 
+	stdin_flags = fcntl(STDIN_FILENO, F_GETFL);
+	fcntl(STDIN_FILENO, F_SETFL, stdin_flags | O_NONBLOCK); //getkey() drains whatever is pending and never blocks inside read()
+
 	size_of_display = screen_var_info.yres_virtual * screen_fix_info.line_length; //Set the size of the display
 
-	framebuffer = (color_t*) mmap(NULL, size_of_display, PROT_WRITE, MAP_SHARED, framebuffer_desc, 0); //Maps the frame buffer in memory
+	framebuffer = (unsigned char*) mmap(NULL, size_of_display, PROT_READ | PROT_WRITE, MAP_SHARED, framebuffer_desc, 0); //Maps the frame buffer in memory; readable so regions can be copied and scrolled
+	display_origin = pixel_address(framebuffer, screen_var_info.xoffset, screen_var_info.yoffset);
+	draw_buffer = display_origin; //Draw straight to the display until double buffering is enabled
+	original_yoffset = screen_var_info.yoffset;
+
+	//Panning to where the display already is only succeeds if the driver supports panning at all
+	can_pan = screen_fix_info.ypanstep == 1 && screen_var_info.yres_virtual > screen_var_info.yres
+		&& ioctl(framebuffer_desc, FBIOPAN_DISPLAY, &screen_var_info) == 0;
 
 	clear_screen(); //Make sure the screen is cleared so there's no text in the background
 }
 
 //Exit the graphics library and reset the settings of the frame to its default settings, including unmapping
 void exit_graphics(){
+	set_raster_threads(1); //Stop any tiled-rendering workers
+	disable_double_buffer(); //Flush anything still pending in the back buffer and free it
 	clear_screen(); //Clear the screen when we're done
 
+	if(can_pan && (int) screen_var_info.yoffset != original_yoffset){ //Scrolling panned the display; leave the console where it was
+		screen_var_info.yoffset = original_yoffset;
+		ioctl(framebuffer_desc, FBIOPAN_DISPLAY, &screen_var_info);
+	}
+
 	terminal_settings.c_lflag |= ICANON; //Switch ICANON on again
 	terminal_settings.c_lflag |= ECHO; //Switch ECHO on again
 	ioctl(STDIN_FILENO, TCSETS, &terminal_settings); //Set these new settings
+	fcntl(STDIN_FILENO, F_SETFL, stdin_flags); //Make stdin blocking again
 
 	munmap(framebuffer, size_of_display); //Unmap the framebuffer from our address space
 	close(framebuffer_desc); //Close the file descriptor of the framebuffer
+	virtual_display = 0;
+
+#ifdef GRAPHICS_STATS
+	dump_graphics_stats(STDERR_FILENO); //The terminal is back to normal, so the table stays readable
+#endif
 }
 
 //Clear the screen of all its current color
 void clear_screen(){
+	if(virtual_display){ //The terminal is not what is being drawn on, and stdout may be a benchmark's report
+		return;
+	}
+
 	write(STDOUT_FILENO, "\033[2J", 4); //Tells the terminal to clear itself by printing out to the standard output; the first part of the string is an octal escape sequence
 }
 
-//Check to see if there is a character waiting in the buffer.
-//If a character is there, return it to the caller.
+// Keyboard input ----------------------------------------------------------
+//
+//stdin is non-blocking while the library is active.  Whenever the key ring
+//buffer runs dry, one readv() pulls in every byte that is pending, so a
+//burst of keys costs one system call instead of one per key.  Waiting is
+//done with ppoll() on input_fd(), so callers can also put that descriptor
+//in their own poll/epoll set.
+
+#define KEY_BUFFER_SIZE 256 //Must be a power of two
+
+char key_buffer[KEY_BUFFER_SIZE];
+unsigned int key_head; //Total bytes taken out of key_buffer; the next key is key_buffer[key_head % KEY_BUFFER_SIZE]
+unsigned int key_tail; //Total bytes put into key_buffer
+long key_timeout_ms = 5000; //How long getkey() waits for a key: 5 seconds by default, 0 never waits, negative waits forever
+
+//The descriptor keys are read from, for callers that want to wait on it themselves
+int input_fd(){
+	return STDIN_FILENO;
+}
+
+//Set how long getkey() waits when no key is pending (5000 ms by default): 0 returns at once, a negative value waits until a key arrives
+void set_key_timeout(long ms){
+	key_timeout_ms = ms;
+}
+
+//Move every pending byte of stdin into the ring buffer with one system call
+static void fill_key_buffer(){
+	unsigned int free_bytes = KEY_BUFFER_SIZE - (key_tail - key_head);
+	unsigned int tail = key_tail & (KEY_BUFFER_SIZE - 1);
+	unsigned int first_part = KEY_BUFFER_SIZE - tail; //Free space before the end of the array
+	struct iovec parts[2];
+
+	if(free_bytes == 0){
+		return;
+	}
+
+	if(first_part > free_bytes){
+		first_part = free_bytes;
+	}
+
+	parts[0].iov_base = key_buffer + tail;
+	parts[0].iov_len = first_part;
+	parts[1].iov_base = key_buffer; //Wraps around to the start of the array
+	parts[1].iov_len = free_bytes - first_part;
+
+	ssize_t bytes_read = readv(STDIN_FILENO, parts, parts[1].iov_len ? 2 : 1);
+	if(bytes_read > 0){
+		key_tail += bytes_read;
+	}
+}
+
+//Wait until stdin is readable or timeout runs out (NULL waits forever); returns 1 if input is ready
+static int wait_for_input(const struct timespec* timeout){
+	struct pollfd stdin_poll = {STDIN_FILENO, POLLIN, 0};
+
+	return ppoll(&stdin_poll, 1, timeout, NULL) > 0;
+}
+
+//Time left from now until the CLOCK_MONOTONIC time deadline, or zero if it has passed
+static struct timespec time_until(const struct timespec* deadline){
+	struct timespec now;
+	struct timespec left;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left.tv_sec = deadline->tv_sec - now.tv_sec;
+	left.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+	if(left.tv_nsec < 0){
+		left.tv_sec--;
+		left.tv_nsec += 1000000000;
+	}
+
+	if(left.tv_sec < 0){
+		left.tv_sec = 0;
+		left.tv_nsec = 0;
+	}
+
+	return left;
+}
+
+//Take the next key out of the ring buffer, reading stdin if the buffer is empty; '\0' if there is none
+static char next_key(){
+	if(key_head == key_tail){
+		fill_key_buffer();
+	}
+
+	if(key_head == key_tail){
+		return '\0';
+	}
+
+	return key_buffer[key_head++ & (KEY_BUFFER_SIZE - 1)];
+}
+
+//Return the next key pressed, or '\0' if none arrives within the key timeout (see set_key_timeout())
 char getkey(){
-	fd_set rfds; //File descriptor set manages which file descriptors are being used; is passed into select()
-	FD_ZERO(&rfds); //Clear the above set just to be safe
-	FD_SET(0, &rfds); //Add file descriptor 0 (stdin) to the descriptor set
+	char key = next_key();
+
+	if(key != '\0' || key_timeout_ms == 0){
+		return key;
+	}
 
-	struct timeval time_wait;
-	time_wait.tv_sec = 5; //Wait 25seconds
-	time_wait.tv_usec = 0; //Wait 0 microseconds
-	int char_in_buffer = select(STDIN_FILENO+1, &rfds, NULL, NULL, &time_wait); //Check 1 device (file descriptor 0, a.k.a. stdin); first parameter must be highest file descriptor device + 1
+	if(key_timeout_ms < 0){
+		wait_for_input(NULL);
+	} else{
+		struct timespec timeout = {key_timeout_ms / 1000, (key_timeout_ms % 1000) * 1000000};
+		wait_for_input(&timeout);
+	}
+
+	return next_key();
+}
 
-	char buffered_char = '\0';
+//Return the next key pressed, or '\0' if none arrives before deadline (CLOCK_MONOTONIC time).
+//Returns as soon as a key is available, so a render loop can use it to wait out the rest of its frame.
+char getkey_until(const struct timespec* deadline){
+	char key = next_key();
 
-	if(char_in_buffer){ //There is a character in the stdin buffer
-		read(0, &buffered_char, sizeof(buffered_char)); //Read 1 byte of data from file descriptor 0 (stdin) and store it in buffered_char
+	if(key != '\0'){
+		return key;
 	}
 
-	return buffered_char;
+	struct timespec timeout = time_until(deadline);
+	wait_for_input(&timeout);
+
+	return next_key();
+}
+
+//Add ns nanoseconds to the time t
+static void add_ns(struct timespec* t, long long ns){
+	ns += t->tv_nsec;
+	t->tv_sec += ns / 1000000000;
+	t->tv_nsec = ns % 1000000000;
+}
+
+//Nanoseconds from time a to time b (negative if b is earlier)
+static long long ns_between(const struct timespec* a, const struct timespec* b){
+	return (long long) (b->tv_sec - a->tv_sec) * 1000000000 + (b->tv_nsec - a->tv_nsec);
+}
+
+//Sleep until the CLOCK_MONOTONIC time deadline; being interrupted by a signal does not cut the sleep short
+static void sleep_until(const struct timespec* deadline){
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR){
+		//The deadline is absolute, so retrying with it cannot oversleep
+	}
 }
 
 //Sleep for a specified number of milliseconds
@@ -84,89 +291,2960 @@ void sleep_ms(long ms){
 		return;
 	}
 
-	//Create the struct to hold the nanoseconds we're sleeping for
-	struct timespec sleep_time_struct;
-	sleep_time_struct.tv_sec = 0; //Seconds to sleep
+	//Sleep until an absolute deadline so the whole delay is one call, however long it is
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	add_ns(&deadline, ms * 1000000LL);
+	sleep_until(&deadline);
+}
+
+// Frame pacing --------------------------------------------------------------
+//
+//A render loop calls frame_begin() before drawing and frame_end(target_hz)
+//after.  frame_end() sleeps until an absolute deadline that advances by
+//exactly one period per frame, so time spent drawing is absorbed instead of
+//added on, and the frame rate does not drift.  A frame that finishes past
+//its deadline is counted as missed and the schedule restarts from now
+//rather than rushing to catch up.  frame_end_key() does the same wait but
+//returns early when a key is pressed.
+
+#define FRAME_HISTOGRAM_BUCKETS 24 //Bucket i counts times below 2^i microseconds (and at least 2^(i-1)); the last also takes anything longer
+
+struct frame_stats{
+	unsigned long frames; //Frames completed with frame_end()
+	unsigned long missed_deadlines; //Frames whose drawing ran past their deadline
+	long long total_render_ns; //Time spent between frame_begin() and frame_end(), summed
+	long long worst_render_ns;
+	unsigned long render_histogram[FRAME_HISTOGRAM_BUCKETS]; //Time from frame_begin() to frame_end()
+	unsigned long wake_histogram[FRAME_HISTOGRAM_BUCKETS]; //How late frame_end() woke up after its deadline
+};
+
+struct frame_stats frame_stats;
+struct timespec frame_start; //When the current frame began
+struct timespec frame_deadline; //When the current frame is due to end
+int frame_schedule_started;
+
+//Count a duration in the histogram bucket for its power-of-two number of microseconds
+static void add_to_histogram(unsigned long* histogram, long long ns){
+	long long us = ns / 1000;
+	int bucket = 0;
+
+	while(us > 0 && bucket < FRAME_HISTOGRAM_BUCKETS - 1){
+		us >>= 1;
+		bucket++;
+	}
+
+	histogram[bucket]++;
+}
 
-	//999,999,999 ns (1 second) is the longest you can nanosleep() at a given time,
-	//so if the input number is less than that, sleeping can be done in one call
-	if(ms <= 999){
-		sleep_time_struct.tv_nsec = ms*1000000;
-		nanosleep(&sleep_time_struct, NULL);
-	} else{ //else, it will require a loop that calls nanosleep() several times
-		while(ms > 0){ //There is still time left to sleep
-			ms -= 999;
-			if(ms > 0){
-				sleep_time_struct.tv_nsec = 999000000; //There is some time left over after subtracting 999,000,000 ns, so we can sleep for that time
-			} else{
-				sleep_time_struct.tv_nsec = (ms + 999)*1000000; //There is less than 999,000,000 ns left, so add it back on for now and sleep for that specific amount of nanoseconds
-			}
-			nanosleep(&sleep_time_struct, NULL);
-		}
+//Mark the start of a frame's drawing
+void frame_begin(){
+	clock_gettime(CLOCK_MONOTONIC, &frame_start);
+
+	if(!frame_schedule_started){ //The first frame's period starts now
+		frame_deadline = frame_start;
+		frame_schedule_started = 1;
 	}
 }
 
-//Draw 1 pixel located at the coordinate (x, y) with the a specified color
-void draw_pixel(int x, int y, color_t color){
-	//Do not try drawing a pixel off screen/out of bounds; it's unncessary
-	if(x < 0 || y < 0 || x > screen_var_info.xres_virtual || y > screen_var_info.yres_virtual){
-		return;
+//Count a finished frame and move the deadline on to its end at target_hz frames per second.
+//Returns 0 if there is nothing to wait for: the frame is unpaced or already past its deadline.
+static int finish_frame(int target_hz){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	long long render_ns = ns_between(&frame_start, &now);
+	frame_stats.frames++;
+	frame_stats.total_render_ns += render_ns;
+	if(render_ns > frame_stats.worst_render_ns){
+		frame_stats.worst_render_ns = render_ns;
+	}
+	add_to_histogram(frame_stats.render_histogram, render_ns);
+
+	if(target_hz <= 0){ //Unpaced; only the statistics are wanted
+		return 0;
+	}
+
+	add_ns(&frame_deadline, 1000000000LL / target_hz);
+
+	if(ns_between(&frame_deadline, &now) > 0){ //Already late: count it and restart the schedule from now
+		frame_stats.missed_deadlines++;
+		frame_deadline = now;
+		return 0;
 	}
 
-	int offset = (y * screen_var_info.xres_virtual) + x; //Set the offset in order to later modify that address using pointer arithmetic
-	color_t* pixel = framebuffer + offset; //Navigate to necessary address
-	*pixel = color; //Set the color of the necessary pixel
+	return 1;
 }
 
-//Draw a rectangle located at (x, y) with specified height, width, and unsigned 16-bit color
-void draw_rect(int x1, int y1, int width, int height, color_t c){
-	//Return if the rectangle will be completely off screen
-	if(((x1+width) < 0 && (y1+height) < 0) || (x1 > screen_var_info.xres_virtual && y1 > screen_var_info.yres_virtual)){
+//Note how late a wait for the frame deadline woke up
+static void record_wake(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	add_to_histogram(frame_stats.wake_histogram, ns_between(&frame_deadline, &now));
+}
+
+//Mark the end of a frame's drawing and sleep until the frame's deadline at target_hz frames per second
+void frame_end(int target_hz){
+	if(!finish_frame(target_hz)){
 		return;
 	}
 
-	int i = 0;
+	sleep_until(&frame_deadline);
+	record_wake();
+}
+
+//Like frame_end(), but wait out the frame with getkey_until() so an interactive loop can react at once.
+//Returns the key that ended the wait early, or '\0' if the deadline came first.
+char frame_end_key(int target_hz){
+	if(!finish_frame(target_hz)){
+		return next_key();
+	}
+
+	char key = getkey_until(&frame_deadline);
+	if(key == '\0'){ //Only a full wait says anything about wake-up latency
+		record_wake();
+	}
+
+	return key;
+}
+
+//The statistics of every frame since init_graphics() or the last reset_frame_stats()
+const struct frame_stats* get_frame_stats(){
+	return &frame_stats;
+}
+
+//Clear the frame statistics and start a new frame schedule
+void reset_frame_stats(){
+	memset(&frame_stats, 0, sizeof(frame_stats));
+	frame_schedule_started = 0;
+}
+
+// Clipping ----------------------------------------------------------------
+
+//An axis-aligned region of the display
+struct bounds{
+	int x1, y1; //Top-left corner (inclusive)
+	int x2, y2; //Bottom-right corner (exclusive)
+};
+
+struct bounds screen_bounds; //The whole drawable display; set up in init_graphics
+
+//Clip the rectangle (*x, *y, *width, *height) against clip.
+//Returns 0 if nothing of the rectangle is left inside it.
+static int clip_rect(const struct bounds* clip, int* x, int* y, int* width, int* height){
+	int x2 = *x + *width; //One past the right edge
+	int y2 = *y + *height; //One past the bottom edge
+
+	if(*x < clip->x1) *x = clip->x1;
+	if(*y < clip->y1) *y = clip->y1;
+	if(x2 > clip->x2) x2 = clip->x2;
+	if(y2 > clip->y2) y2 = clip->y2;
+
+	*width = x2 - *x;
+	*height = y2 - *y;
+
+	return *width > 0 && *height > 0;
+}
+
+// Statistics --------------------------------------------------------------
+//
+//Built only with -DGRAPHICS_STATS; otherwise every STATS_ macro below is
+//empty and none of this code exists.  The counters are shared by the raster
+//threads, so they are bumped with atomic adds, the same way tiled rendering
+//hands out bands.  Time per primitive is summed over all threads, so with
+//several raster threads it can add up to more than the wall-clock time.
+
+#ifdef GRAPHICS_STATS
+enum primitive_kind{
+	PRIMITIVE_PIXEL,
+	PRIMITIVE_FILL_RECT,
+	PRIMITIVE_RECT,
+	PRIMITIVE_LINE, //Straight lines, including draw_vline()
+	PRIMITIVE_CIRCLE, //Outlines and filled
+	PRIMITIVE_POLYGON,
+	PRIMITIVE_TEXT, //Plain and anti-aliased
+	PRIMITIVE_BLEND, //Blended rectangles and masks
+	PRIMITIVE_SPRITE,
+	PRIMITIVE_COPY, //copy_rect() and scroll_region()
+	NUM_PRIMITIVE_KINDS
+};
+
+const char* primitive_names[NUM_PRIMITIVE_KINDS] = {"pixel", "fill_rect", "rect", "line", "circle", "polygon", "text", "blend", "sprite", "copy"};
+
+struct graphics_stats{
+	unsigned long long pixels_written; //Pixels stored into the draw buffer, by every path
+	unsigned long long pixels_clipped; //Pixels of primitives' bounding boxes that fell outside the screen
+	unsigned long long bytes_flushed; //Bytes present() copied from the back buffer to the framebuffer
+	unsigned long long primitives[NUM_PRIMITIVE_KINDS]; //Primitives drawn or submitted, by kind
+	unsigned long long primitive_ns[NUM_PRIMITIVE_KINDS]; //Time spent rasterizing them, summed over threads
+};
+
+struct graphics_stats graphics_counters;
+
+#define STATS_ADD(counter, amount) __sync_fetch_and_add(&graphics_counters.counter, (unsigned long long) (amount))
+#define STATS_PRIMITIVE(kind, x, y, width, height) count_primitive(kind, x, y, width, height)
+#define STATS_TIMER_START() struct timespec stats_start; clock_gettime(CLOCK_MONOTONIC, &stats_start)
+#define STATS_TIMER_STOP(kind) stop_primitive_timer(kind, &stats_start)
+
+//Count one primitive of a kind whose bounding box is width x height at (x, y), and how much of that box is off screen
+static void count_primitive(int kind, int x, int y, int width, int height){
+	long long area = (long long) width * height;
+
+	STATS_ADD(primitives[kind], 1);
+	if(area > 0 && clip_rect(&screen_bounds, &x, &y, &width, &height)){
+		area -= (long long) width * height;
+	}
+	if(area > 0){
+		STATS_ADD(pixels_clipped, area);
+	}
+}
+
+//Add the time since start to a kind of primitive
+static void stop_primitive_timer(int kind, const struct timespec* start){
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	STATS_ADD(primitive_ns[kind], ns_between(start, &now));
+}
+
+//The counters since the program started or the last reset_graphics_stats()
+const struct graphics_stats* graphics_stats(){
+	return &graphics_counters;
+}
+
+void reset_graphics_stats(){
+	memset(&graphics_counters, 0, sizeof(graphics_counters));
+}
 
-	for(i = 0; i < width; i++){ //Draw top side of rectangle
-		draw_pixel(x1++, y1, c);
+//Write the counters to fd as a small table
+void dump_graphics_stats(int fd){
+	char line[160];
+	int length = 0;
+	int kind = 0;
+
+	length = snprintf(line, sizeof(line), "graphics stats: %llu pixels written, %llu pixels clipped, %llu bytes flushed\n",
+		graphics_counters.pixels_written, graphics_counters.pixels_clipped, graphics_counters.bytes_flushed);
+	write(fd, line, length);
+
+	length = snprintf(line, sizeof(line), "%-10s %12s %12s %10s\n", "primitive", "count", "total ms", "avg us");
+	write(fd, line, length);
+
+	for(kind = 0; kind < NUM_PRIMITIVE_KINDS; kind++){
+		unsigned long long count = graphics_counters.primitives[kind];
+		unsigned long long ns = graphics_counters.primitive_ns[kind];
+
+		if(count == 0 && ns == 0){
+			continue;
+		}
+
+		length = snprintf(line, sizeof(line), "%-10s %12llu %12.3f %10.3f\n", primitive_names[kind], count, ns / 1e6, count ? ns / 1e3 / count : 0.0);
+		write(fd, line, length);
 	}
+}
+#else
+#define STATS_ADD(counter, amount)
+#define STATS_PRIMITIVE(kind, x, y, width, height)
+#define STATS_TIMER_START()
+#define STATS_TIMER_STOP(kind)
+#endif
+
+// Pixel formats -----------------------------------------------------------
+//
+//color_t is always RGB565, as built by MAKE_COLOR.  Every drawing call
+//converts its color once to the framebuffer's native pixel value, then
+//hands it to span writers specialized at compile time for one pixel size,
+//so the per-pixel loops never test the format.  init_graphics() picks the
+//writers from bits_per_pixel and the red/green/blue bitfields.
+//
+//Blending reads the destination back, so it needs to know the channel
+//layout too: RGB565 framebuffers get SIMD kernels that unpack 8 (SSE2) or
+//16 (AVX2) pixels at once, and every other format takes a scalar path that
+//pulls the channels out with the bitfields.
 
-	for(i = 0; i < height; i++){ //Draw right side of rectangle
-		draw_pixel(x1, y1++, c);
+struct pixel_backend{
+	int bytes_per_pixel;
+	void (*fill_span)(unsigned char* dst, int count, uint32_t pixel); //Write count pixels of one row
+	void (*fill_column)(unsigned char* dst, int count, int stride, uint32_t pixel); //Write count pixels going down, stride bytes apart
+	void (*blend_span)(unsigned char* dst, const unsigned char* coverage, int count, uint32_t pixel, int alpha); //Blend pixel over count pixels of one row; see blend_weight()
+};
+
+struct pixel_backend backend;
+
+#ifdef __SSE2__
+//Bring dst to 16-byte alignment with one 64-bit store, then fill 16 bytes per store
+#define FILL_SPAN_SSE2(type, dst, count, pattern) \
+	if(count * (int) sizeof(type) >= 24 && ((uintptr_t) dst & 15)){ \
+		*(wide_pixels_t*) dst = pattern; \
+		dst += 8 / sizeof(type); \
+		count -= 8 / sizeof(type); \
+	} \
+	__m128i wide_pattern = _mm_set1_epi64x(pattern); \
+	while(count * (int) sizeof(type) >= 16 && !((uintptr_t) dst & 15)){ \
+		_mm_store_si128((__m128i*) dst, wide_pattern); \
+		dst += 16 / sizeof(type); \
+		count -= 16 / sizeof(type); \
 	}
+#else
+#define FILL_SPAN_SSE2(type, dst, count, pattern)
+#endif
+
+//Generate fill_span_<bits> and fill_column_<bits> for a depth whose pixel is a whole integer type.
+//repeat copies one pixel into every lane of a 64-bit word.  Spans are clipped by the caller;
+//single pixels are written until dst is 8-byte aligned, then 8 or 16 bytes go out per store.
+#define DEFINE_SPAN_WRITERS(bits, type, repeat) \
+static void fill_span_##bits(unsigned char* dst_bytes, int count, uint32_t pixel){ \
+	type* dst = (type*) dst_bytes; \
+	wide_pixels_t pattern = (wide_pixels_t) (type) pixel * (repeat); \
+	while(count > 0 && ((uintptr_t) dst & 7)){ \
+		*dst++ = (type) pixel; \
+		count--; \
+	} \
+	FILL_SPAN_SSE2(type, dst, count, pattern) \
+	while(count * (int) sizeof(type) >= 8){ \
+		*(wide_pixels_t*) dst = pattern; \
+		dst += 8 / sizeof(type); \
+		count -= 8 / sizeof(type); \
+	} \
+	while(count > 0){ \
+		*dst++ = (type) pixel; \
+		count--; \
+	} \
+} \
+static void fill_column_##bits(unsigned char* dst, int count, int stride, uint32_t pixel){ \
+	for(; count > 0; count--){ \
+		*(type*) dst = (type) pixel; \
+		dst += stride; \
+	} \
+}
 
-	for(i = 0; i < width; i++){ //Draw bottom side of rectangle
-		draw_pixel(x1--, y1, c);
+DEFINE_SPAN_WRITERS(8, uint8_t, 0x0101010101010101ULL)
+DEFINE_SPAN_WRITERS(16, uint16_t, 0x0001000100010001ULL)
+DEFINE_SPAN_WRITERS(32, uint32_t, 0x0000000100000001ULL)
+
+//24-bit pixels are not a whole integer type: write 4 pixels at a time as three 32-bit words
+static void fill_span_24(unsigned char* dst, int count, uint32_t pixel){
+	unsigned char b0 = pixel, b1 = pixel >> 8, b2 = pixel >> 16; //Little-endian byte order of one pixel
+	uint32_t words[3] = { //The 12 bytes of 4 consecutive pixels
+		b0 | (b1 << 8) | (b2 << 16) | ((uint32_t) b0 << 24),
+		b1 | (b2 << 8) | (b0 << 16) | ((uint32_t) b1 << 24),
+		b2 | (b0 << 8) | (b1 << 16) | ((uint32_t) b2 << 24)
+	};
+
+	while(count >= 4){
+		memcpy(dst, words, 12);
+		dst += 12;
+		count -= 4;
 	}
 
-	for(i = 0; i < height; i++){ //Draw left side of rectangle
-		draw_pixel(x1, y1--, c);
+	while(count > 0){
+		dst[0] = b0;
+		dst[1] = b1;
+		dst[2] = b2;
+		dst += 3;
+		count--;
 	}
 }
 
-//Draw a given character found in the iso_font array with given color c at location (x, y)
-void draw_char(int x, int y, const char character, color_t c){
+static void fill_column_24(unsigned char* dst, int count, int stride, uint32_t pixel){
+	for(; count > 0; count--){
+		dst[0] = pixel;
+		dst[1] = pixel >> 8;
+		dst[2] = pixel >> 16;
+		dst += stride;
+	}
+}
+
+//Weight, out of 256, that a source pixel gets over the destination for a coverage and an alpha out of 255.
+//Rounds coverage * alpha / 255 to the nearest integer, then stretches 255 to 256 so full coverage is an exact copy.
+//The SIMD kernels compute the same value in 16-bit lanes, so every path blends to the same pixels.
+static inline int blend_weight(int coverage, int alpha){
+	int t = coverage * alpha + 128;
+	int weight = (t + (t >> 8)) >> 8;
+
+	return weight + (weight >> 7);
+}
+
+//Mix one channel: weight/256 of the source over the rest of the destination
+static inline uint32_t blend_channel(uint32_t dst, uint32_t src, int weight){
+	return (dst * (256 - weight) + src * weight) >> 8;
+}
+
+//Blend an RGB565 source, already split into channels, over one RGB565 pixel
+static inline uint16_t blend_565(uint16_t dst, int red, int green, int blue, int weight){
+	return (blend_channel(dst >> 11, red, weight) << 11)
+		| (blend_channel((dst >> 5) & 0x3f, green, weight) << 5)
+		| blend_channel(dst & 0x1f, blue, weight);
+}
+
+#ifdef __SSE2__
+//Blend 8 RGB565 pixels: d holds the destination, red/green/blue the source channels and weight the per-pixel weights, all in 16-bit lanes.
+//No lane can overflow: every product and sum is at most 63 * 256.
+static inline __m128i blend_565_sse2(__m128i d, __m128i red, __m128i green, __m128i blue, __m128i weight){
+	__m128i inverse = _mm_sub_epi16(_mm_set1_epi16(256), weight);
+	__m128i dst_red = _mm_srli_epi16(d, 11);
+	__m128i dst_green = _mm_and_si128(_mm_srli_epi16(d, 5), _mm_set1_epi16(0x3f));
+	__m128i dst_blue = _mm_and_si128(d, _mm_set1_epi16(0x1f));
+
+	dst_red = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(dst_red, inverse), _mm_mullo_epi16(red, weight)), 8);
+	dst_green = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(dst_green, inverse), _mm_mullo_epi16(green, weight)), 8);
+	dst_blue = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(dst_blue, inverse), _mm_mullo_epi16(blue, weight)), 8);
+
+	return _mm_or_si128(_mm_or_si128(_mm_slli_epi16(dst_red, 11), _mm_slli_epi16(dst_green, 5)), dst_blue);
+}
+
+//blend_weight() for 8 coverage values in 16-bit lanes; coverage * alpha fits since both are at most 255
+static inline __m128i blend_weight_sse2(__m128i coverage, __m128i alpha){
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(coverage, alpha), _mm_set1_epi16(128));
+	__m128i weight = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+
+	return _mm_add_epi16(weight, _mm_srli_epi16(weight, 7));
+}
+#endif
+
+#ifdef __AVX2__
+//The AVX2 versions of the two helpers above, 16 pixels at a time
+static inline __m256i blend_565_avx2(__m256i d, __m256i red, __m256i green, __m256i blue, __m256i weight){
+	__m256i inverse = _mm256_sub_epi16(_mm256_set1_epi16(256), weight);
+	__m256i dst_red = _mm256_srli_epi16(d, 11);
+	__m256i dst_green = _mm256_and_si256(_mm256_srli_epi16(d, 5), _mm256_set1_epi16(0x3f));
+	__m256i dst_blue = _mm256_and_si256(d, _mm256_set1_epi16(0x1f));
+
+	dst_red = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(dst_red, inverse), _mm256_mullo_epi16(red, weight)), 8);
+	dst_green = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(dst_green, inverse), _mm256_mullo_epi16(green, weight)), 8);
+	dst_blue = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(dst_blue, inverse), _mm256_mullo_epi16(blue, weight)), 8);
+
+	return _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi16(dst_red, 11), _mm256_slli_epi16(dst_green, 5)), dst_blue);
+}
+
+static inline __m256i blend_weight_avx2(__m256i coverage, __m256i alpha){
+	__m256i t = _mm256_add_epi16(_mm256_mullo_epi16(coverage, alpha), _mm256_set1_epi16(128));
+	__m256i weight = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+
+	return _mm256_add_epi16(weight, _mm256_srli_epi16(weight, 7));
+}
+#endif
+
+//Blend an RGB565 pixel over count RGB565 pixels with constant alpha, scaled per pixel by coverage unless it is NULL
+static void blend_span_565(unsigned char* dst_bytes, const unsigned char* coverage, int count, uint32_t pixel, int alpha){
+	uint16_t* dst = (uint16_t*) dst_bytes;
+	int red = pixel >> 11;
+	int green = (pixel >> 5) & 0x3f;
+	int blue = pixel & 0x1f;
+	int weight = blend_weight(255, alpha);
+
+#ifdef __AVX2__
+	__m256i red_16 = _mm256_set1_epi16(red), green_16 = _mm256_set1_epi16(green), blue_16 = _mm256_set1_epi16(blue);
+	__m256i alpha_16 = _mm256_set1_epi16(alpha), weight_16 = _mm256_set1_epi16(weight);
+
+	for(; count >= 16; count -= 16, dst += 16){
+		__m256i d = _mm256_loadu_si256((const __m256i*) dst);
+
+		if(coverage){
+			weight_16 = blend_weight_avx2(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) coverage)), alpha_16);
+			coverage += 16;
+		}
+		_mm256_storeu_si256((__m256i*) dst, blend_565_avx2(d, red_16, green_16, blue_16, weight_16));
+	}
+#endif
+#ifdef __SSE2__
+	__m128i red_8 = _mm_set1_epi16(red), green_8 = _mm_set1_epi16(green), blue_8 = _mm_set1_epi16(blue);
+	__m128i alpha_8 = _mm_set1_epi16(alpha), weight_8 = _mm_set1_epi16(weight);
+
+	for(; count >= 8; count -= 8, dst += 8){
+		__m128i d = _mm_loadu_si128((const __m128i*) dst);
+
+		if(coverage){ //Widen 8 coverage bytes to 16-bit lanes
+			weight_8 = blend_weight_sse2(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) coverage), _mm_setzero_si128()), alpha_8);
+			coverage += 8;
+		}
+		_mm_storeu_si128((__m128i*) dst, blend_565_sse2(d, red_8, green_8, blue_8, weight_8));
+	}
+#endif
+
+	for(; count > 0; count--, dst++){ //Whatever the vector loops left over, or everything without SSE2
+		if(coverage){
+			weight = blend_weight(*coverage++, alpha);
+		}
+		*dst = blend_565(*dst, red, green, blue, weight);
+	}
+}
+
+//Blend for any other format: each channel is pulled out with its bitfield, mixed, and put back
+static void blend_span_generic(unsigned char* dst, const unsigned char* coverage, int count, uint32_t pixel, int alpha){
+	const struct fb_bitfield* fields[3] = {&screen_var_info.red, &screen_var_info.green, &screen_var_info.blue};
+	int bytes_per_pixel = backend.bytes_per_pixel;
+	int weight = blend_weight(255, alpha);
 	int i = 0;
-	int j = 0;
 
-	for(i = 0; i < 16; i++){ //Iterate through the rows
-		int curr_row = iso_font[character*16 + i]; //Get the pixel data for row i		
+	for(; count > 0; count--, dst += bytes_per_pixel){
+		uint32_t value = 0;
 
-		for(j = 0; j < 8; j++){ //Iterate left through right in this specific row
-			int draw_pixel_boolean = curr_row & 0x01; //AND the current row with 0x80 (1000 0000) to get the most significant bit
-			curr_row >>= 1; //Shift the current row value right by 1 so we can continue to grab the least significant bit
-			if(draw_pixel_boolean){ //If our AND'd bit is 1, draw the pixel there
-				draw_pixel(x + j, y + i, c);
-			}
+		if(coverage){
+			weight = blend_weight(*coverage++, alpha);
 		}
+		if(weight == 0){ //Nothing to do, and most of an anti-aliased glyph is empty
+			continue;
+		}
+
+		memcpy(&value, dst, bytes_per_pixel); //Little-endian, like the span writers
+		for(i = 0; i < 3; i++){
+			uint32_t mask = ((1u << fields[i]->length) - 1) << fields[i]->offset;
+			uint32_t mixed = blend_channel((value & mask) >> fields[i]->offset, (pixel & mask) >> fields[i]->offset, weight);
+
+			value = (value & ~mask) | (mixed << fields[i]->offset);
+		}
+		memcpy(dst, &value, bytes_per_pixel);
 	}
 }
 
-//Draw a given piece of text onto the display at location (x, y) and color c
-void draw_text(int x, int y, const char* text, color_t c){
+//Whether the framebuffer's native format is RGB565, the same as color_t
+static int native_is_rgb565(){
+	return screen_var_info.bits_per_pixel == 16 && screen_var_info.red.offset == 11 && screen_var_info.red.length == 5
+		&& screen_var_info.green.offset == 5 && screen_var_info.green.length == 6 && screen_var_info.blue.offset == 0 && screen_var_info.blue.length == 5;
+}
+
+//Rescale an n-bit channel value to fit the framebuffer's bitfield for that channel, then move it into place
+static uint32_t place_channel(uint32_t value, int bits, const struct fb_bitfield* field){
+	uint32_t max = (1u << bits) - 1;
+	uint32_t field_max = (1u << field->length) - 1;
+
+	return ((value * field_max + max/2) / max) << field->offset;
+}
+
+//Convert an RGB565 color_t to the framebuffer's native pixel value
+static uint32_t map_color(color_t c){
+	if(native_is_rgb565()){
+		return c; //Already native
+	}
+
+	return place_channel((c >> 11) & 0x1f, 5, &screen_var_info.red)
+		| place_channel((c >> 5) & 0x3f, 6, &screen_var_info.green)
+		| place_channel(c & 0x1f, 5, &screen_var_info.blue);
+}
+
+#ifdef GRAPHICS_STATS
+struct pixel_backend uncounted_backend; //The real writers, called through the counting ones below
+
+static void count_fill_span(unsigned char* dst, int count, uint32_t pixel){
+	STATS_ADD(pixels_written, count);
+	uncounted_backend.fill_span(dst, count, pixel);
+}
+
+static void count_fill_column(unsigned char* dst, int count, int stride, uint32_t pixel){
+	STATS_ADD(pixels_written, count);
+	uncounted_backend.fill_column(dst, count, stride, pixel);
+}
+
+static void count_blend_span(unsigned char* dst, const unsigned char* coverage, int count, uint32_t pixel, int alpha){
+	STATS_ADD(pixels_written, count);
+	uncounted_backend.blend_span(dst, coverage, count, pixel, alpha);
+}
+#endif
+
+//Choose the span writers for the framebuffer's depth and set up the stride and clip bounds
+static void select_pixel_format(){
+	stride = screen_fix_info.line_length; //Rows can be padded past xres_virtual pixels
+	screen_bounds.x1 = 0;
+	screen_bounds.y1 = 0;
+	screen_bounds.x2 = screen_var_info.xres; //Only the visible part is drawn; the rest of yres_virtual is room for panning
+	screen_bounds.y2 = screen_var_info.yres;
+
+	switch(screen_var_info.bits_per_pixel){
+		case 8:
+			backend.fill_span = fill_span_8;
+			backend.fill_column = fill_column_8;
+			break;
+		case 16:
+			backend.fill_span = fill_span_16;
+			backend.fill_column = fill_column_16;
+			break;
+		case 24:
+			backend.fill_span = fill_span_24;
+			backend.fill_column = fill_column_24;
+			break;
+		case 32:
+			backend.fill_span = fill_span_32;
+			backend.fill_column = fill_column_32;
+			break;
+		default: //Unsupported depth: clip everything away rather than write garbage
+			backend.fill_span = fill_span_8;
+			backend.fill_column = fill_column_8;
+			screen_bounds.x2 = 0;
+			screen_bounds.y2 = 0;
+			break;
+	}
+
+	backend.bytes_per_pixel = screen_var_info.bits_per_pixel / 8;
+	backend.blend_span = native_is_rgb565() ? blend_span_565 : blend_span_generic;
+
+#ifdef GRAPHICS_STATS
+	uncounted_backend = backend; //Every span written goes through a counter first
+	backend.fill_span = count_fill_span;
+	backend.fill_column = count_fill_column;
+	backend.blend_span = count_blend_span;
+#endif
+}
+
+//Address of pixel (x, y) in buffer
+static inline unsigned char* pixel_address(unsigned char* buffer, int x, int y){
+	return buffer + (y * stride) + (x * backend.bytes_per_pixel);
+}
+
+// Double buffering ------------------------------------------------------
+//
+//When enabled, every drawing function writes into a heap back buffer and
+//records the (already clipped) rectangle it touched.  present() then copies
+//only those rectangles to the framebuffer, which is uncached/write-combined
+//memory on real hardware, using non-temporal stores.
+
+#define MAX_DIRTY_RECTS 32 //When more regions than this are dirty they are collapsed into one bounding box
+
+struct bounds dirty_rects[MAX_DIRTY_RECTS];
+int num_dirty_rects;
+
+//Grow rectangle a to also cover rectangle b
+static void union_rect(struct bounds* a, const struct bounds* b){
+	if(b->x1 < a->x1) a->x1 = b->x1;
+	if(b->y1 < a->y1) a->y1 = b->y1;
+	if(b->x2 > a->x2) a->x2 = b->x2;
+	if(b->y2 > a->y2) a->y2 = b->y2;
+}
+
+//Return 1 if rectangles a and b overlap or share part of an edge. Rectangles that only meet at a corner are kept
+//apart: their bounding box can be nearly twice the pixels of the two together.
+static int rects_touch(const struct bounds* a, const struct bounds* b){
+	int x_overlap = a->x1 < b->x2 && b->x1 < a->x2;
+	int y_overlap = a->y1 < b->y2 && b->y1 < a->y2;
+	int x_touch = a->x1 <= b->x2 && b->x1 <= a->x2; //Overlapping, or side by side with no gap
+	int y_touch = a->y1 <= b->y2 && b->y1 <= a->y2;
+
+	return (x_overlap && y_touch) || (y_overlap && x_touch);
+}
+
+//Add the on-screen part of the rectangle at (x, y) with the given width and height to a list of up to MAX_DIRTY_RECTS
+//rectangles, merging it with any it touches
+static void add_rect(struct bounds* rects, int* count, int x, int y, int width, int height){
+	int i = 0;
+
+	if(!clip_rect(&screen_bounds, &x, &y, &width, &height)){ //Only the part on screen matters
+		return;
+	}
+
+	struct bounds rect = {x, y, x + width, y + height};
+
+	//Most calls land inside the rectangle that was just added (e.g. the pixels of one character), so check it first
+	if(*count > 0){
+		struct bounds* last = &rects[*count - 1];
+		if(rect.x1 >= last->x1 && rect.y1 >= last->y1 && rect.x2 <= last->x2 && rect.y2 <= last->y2){
+			return;
+		}
+	}
+
+	//Absorb every rectangle the new one touches; the union may now touch rectangles that were skipped, so start over after each merge
+	for(i = 0; i < *count; i++){
+		if(rects_touch(&rects[i], &rect)){
+			union_rect(&rect, &rects[i]);
+			rects[i] = rects[--*count]; //Remove it; the merged rectangle is re-added below
+			i = -1;
+		}
+	}
+
+	if(*count == MAX_DIRTY_RECTS){ //Out of room; collapse everything into one bounding box
+		for(i = 0; i < *count; i++){
+			union_rect(&rect, &rects[i]);
+		}
+		*count = 0;
+	}
+
+	rects[(*count)++] = rect;
+}
+
+//Record that the rectangle at (x, y) with the given width and height must be copied on the next present()
+static void mark_dirty(int x, int y, int width, int height){
+	add_rect(dirty_rects, &num_dirty_rects, x, y, width, height);
+}
+
+//Copy count bytes from src to dst without pulling dst into the cache
+static void stream_span(unsigned char* dst, const unsigned char* src, int count){
+#ifdef __SSE2__
+	while(count > 0 && ((uintptr_t) dst & 15)){ //Non-temporal stores need a 16-byte aligned destination
+		*dst++ = *src++;
+		count--;
+	}
+
+	while(count >= 16){
+		_mm_stream_si128((__m128i*) dst, _mm_loadu_si128((const __m128i*) src));
+		dst += 16;
+		src += 16;
+		count -= 16;
+	}
+#endif
+
+	while(count > 0){
+		*dst++ = *src++;
+		count--;
+	}
+}
+
+//Copy every dirty region of the back buffer to the framebuffer and start a new frame
+void present(){
 	int i = 0;
+	int y = 0;
 
-	for(i = 0; text[i] != '\0'; i++){ //Iterate through the charactesr in the text
-		draw_char(x + i*8, y, text[i], c); //Draw each character, moving 16 pixels to the right each time
+	if(!back_buffer){ //Drawing already went straight to the display
+		return;
+	}
+
+	for(i = 0; i < num_dirty_rects; i++){
+		struct bounds* rect = &dirty_rects[i];
+		int offset = (rect->y1 * stride) + (rect->x1 * backend.bytes_per_pixel); //Same byte offset in both buffers
+		int row_bytes = (rect->x2 - rect->x1) * backend.bytes_per_pixel;
+
+		for(y = rect->y1; y < rect->y2; y++){ //Copy the region one row at a time
+			stream_span(display_origin + offset, back_buffer + offset, row_bytes);
+			offset += stride;
+		}
+		STATS_ADD(bytes_flushed, (long long) row_bytes * (rect->y2 - rect->y1));
 	}
+
+#ifdef __SSE2__
+	_mm_sfence(); //Make the non-temporal stores visible before the next frame is drawn
+#endif
+
+	num_dirty_rects = 0;
+}
+
+//Start drawing into an off-screen back buffer; nothing reaches the display until present() is called
+//Returns 0 on success, or -1 if the back buffer could not be allocated (drawing then stays direct)
+int enable_double_buffer(){
+	if(back_buffer){ //Already enabled
+		return 0;
+	}
+
+	int size_of_back_buffer = screen_bounds.y2 * stride; //Only the visible rows; same stride as the framebuffer
+
+	if(posix_memalign((void**) &back_buffer, 64, size_of_back_buffer) != 0){ //Cache-line aligned so rows line up with the framebuffer's
+		back_buffer = NULL;
+		return -1;
+	}
+
+	memcpy(back_buffer, display_origin, size_of_back_buffer); //Start from what is on screen, so copies and scrolls see the same pixels
+	num_dirty_rects = 0;
+	draw_buffer = back_buffer;
+
+	return 0;
+}
+
+//Present whatever is still pending, then go back to drawing straight into the framebuffer
+void disable_double_buffer(){
+	if(!back_buffer){
+		return;
+	}
+
+	present();
+	free(back_buffer);
+	back_buffer = NULL;
+	draw_buffer = display_origin;
+}
+
+// Virtual displays ----------------------------------------------------------
+//
+//A virtual display stands in for /dev/fb0 on machines without one, such as
+//headless build hosts.  Its pixels live in a memfd, or in a regular file
+//when a path is given so other programs can look at them, and it is mapped
+//exactly like the framebuffer.  The screen info is filled in the way the
+//fbdev driver would, so everything above it works unchanged; only panning
+//is unavailable.  dump_ppm() saves whatever is on the display, virtual or
+//not, for comparing against golden images.
+
+//Draw into a width x height surface of bits_per_pixel (8, 16, 24 or 32) instead of /dev/fb0.
+//The surface lives in the file at path, or in anonymous memory if path is NULL.
+//Returns 0 on success, or -1 if the surface could not be created.
+int init_graphics_virtual(int width, int height, int bits_per_pixel, const char* path){
+	int line_length = (width * (bits_per_pixel / 8) + 3) & ~3; //Rows padded to 4 bytes, as most drivers do
+	int fd = -1;
+
+	if(width <= 0 || height <= 0 || (bits_per_pixel != 8 && bits_per_pixel != 16 && bits_per_pixel != 24 && bits_per_pixel != 32)){
+		return -1;
+	}
+
+	fd = path ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0644) : memfd_create("graphics", MFD_CLOEXEC);
+	if(fd < 0){
+		return -1;
+	}
+	if(ftruncate(fd, (off_t) line_length * height) < 0){
+		close(fd);
+		return -1;
+	}
+
+	memset(&screen_var_info, 0, sizeof(screen_var_info));
+	memset(&screen_fix_info, 0, sizeof(screen_fix_info));
+	screen_var_info.xres = screen_var_info.xres_virtual = width;
+	screen_var_info.yres = screen_var_info.yres_virtual = height;
+	screen_var_info.bits_per_pixel = bits_per_pixel;
+
+	switch(bits_per_pixel){
+		case 8: //RGB332
+			screen_var_info.red.offset = 5;
+			screen_var_info.red.length = 3;
+			screen_var_info.green.offset = 2;
+			screen_var_info.green.length = 3;
+			screen_var_info.blue.length = 2;
+			break;
+		case 16: //RGB565, the same as color_t
+			screen_var_info.red.offset = 11;
+			screen_var_info.red.length = 5;
+			screen_var_info.green.offset = 5;
+			screen_var_info.green.length = 6;
+			screen_var_info.blue.length = 5;
+			break;
+		default: //RGB888, with the top byte unused at 32 bits
+			screen_var_info.red.offset = 16;
+			screen_var_info.red.length = 8;
+			screen_var_info.green.offset = 8;
+			screen_var_info.green.length = 8;
+			screen_var_info.blue.length = 8;
+			break;
+	}
+
+	strncpy(screen_fix_info.id, "virtual", sizeof(screen_fix_info.id));
+	screen_fix_info.smem_len = line_length * height;
+	screen_fix_info.type = FB_TYPE_PACKED_PIXELS;
+	screen_fix_info.visual = FB_VISUAL_TRUECOLOR;
+	screen_fix_info.line_length = line_length;
+
+	framebuffer_desc = fd;
+	virtual_display = 1;
+	start_graphics();
+
+	return 0;
+}
+
+//Write all of data to fd, however many write() calls that takes
+static int write_all(int fd, const void* data, size_t size){
+	const unsigned char* bytes = data;
+
+	while(size > 0){
+		ssize_t written = write(fd, bytes, size);
+
+		if(written < 0 && errno == EINTR){
+			continue;
+		}
+		if(written <= 0){
+			return -1;
+		}
+		bytes += written;
+		size -= written;
+	}
+
+	return 0;
+}
+
+//Scale a channel out of a native pixel to 8 bits
+static unsigned char channel_to_8_bits(uint32_t pixel, const struct fb_bitfield* field){
+	uint32_t max = (1u << field->length) - 1;
+
+	return max ? (((pixel >> field->offset) & max) * 255 + max/2) / max : 0;
+}
+
+//Save what is on the display (after present(), if double buffering) to path as a binary PPM.
+//Returns 0 on success, or -1 on failure.
+int dump_ppm(const char* path){
+	int width = screen_bounds.x2;
+	int height = screen_bounds.y2;
+	unsigned char* row = malloc(width * 3 + 1);
+	char header[64];
+	int result = 0;
+	int x = 0;
+	int y = 0;
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if(fd < 0 || !row){
+		if(fd >= 0) close(fd);
+		free(row);
+		return -1;
+	}
+
+	result = write_all(fd, header, snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height));
+	for(y = 0; y < height && result == 0; y++){
+		for(x = 0; x < width; x++){
+			uint32_t pixel = 0;
+
+			memcpy(&pixel, pixel_address(display_origin, x, y), backend.bytes_per_pixel);
+			row[x*3] = channel_to_8_bits(pixel, &screen_var_info.red);
+			row[x*3 + 1] = channel_to_8_bits(pixel, &screen_var_info.green);
+			row[x*3 + 2] = channel_to_8_bits(pixel, &screen_var_info.blue);
+		}
+		result = write_all(fd, row, width * 3);
+	}
+
+	free(row);
+	if(close(fd) < 0){
+		result = -1;
+	}
+
+	return result;
+}
+
+// Rasterizers --------------------------------------------------------------
+//
+//These write already-converted native pixels into draw_buffer, clipped to
+//an arbitrary region, and do no dirty tracking.  The public drawing calls
+//below clip them to the screen; submit() clips them to one band at a time.
+
+//Write one pixel at (x, y) if it lies inside clip
+static void raster_pixel(const struct bounds* clip, int x, int y, uint32_t pixel){
+	//Do not try drawing a pixel off screen/out of bounds; it's unncessary
+	if(x < clip->x1 || y < clip->y1 || x >= clip->x2 || y >= clip->y2){
+		return;
+	}
+
+	backend.fill_span(pixel_address(draw_buffer, x, y), 1, pixel); //Set the color of the necessary pixel
+}
+
+//Fill the part of a solid rectangle that lies inside clip
+static void raster_fill_rect(const struct bounds* clip, int x, int y, int width, int height, uint32_t pixel){
+	if(!clip_rect(clip, &x, &y, &width, &height)){ //Clip once up front instead of per pixel
+		return;
+	}
+
+	unsigned char* row = pixel_address(draw_buffer, x, y); //Top-left pixel of the clipped rectangle
+	int i = 0;
+
+	for(i = 0; i < height; i++){ //Write the rectangle one row (span) at a time
+		backend.fill_span(row, width, pixel);
+		row += stride;
+	}
+}
+
+//Draw the part of a vertical line that lies inside clip
+static void raster_vline(const struct bounds* clip, int x, int y, int length, uint32_t pixel){
+	int width = 1;
+
+	if(!clip_rect(clip, &x, &y, &width, &length)){
+		return;
+	}
+
+	backend.fill_column(pixel_address(draw_buffer, x, y), length, stride, pixel); //Steps down one row at a time; no per-pixel bounds check or multiply
+}
+
+//Stroke the outline covering (x, y) through (x + width, y + height), the same pixels the old pixel-by-pixel walk touched
+static void raster_rect(const struct bounds* clip, int x, int y, int width, int height, uint32_t pixel){
+	if(width < 0 || height < 0){
+		return;
+	}
+
+	raster_fill_rect(clip, x, y, width + 1, 1, pixel); //Top side of rectangle
+	raster_fill_rect(clip, x, y + height, width + 1, 1, pixel); //Bottom side of rectangle
+	raster_vline(clip, x, y + 1, height - 1, pixel); //Left side of rectangle
+	raster_vline(clip, x + width, y + 1, height - 1, pixel); //Right side of rectangle
+}
+
+//Draw 1 pixel located at the coordinate (x, y) with the a specified color
+void draw_pixel(int x, int y, color_t color){
+	if(back_buffer){
+		mark_dirty(x, y, 1, 1);
+	}
+	STATS_PRIMITIVE(PRIMITIVE_PIXEL, x, y, 1, 1);
+
+	STATS_TIMER_START();
+	raster_pixel(&screen_bounds, x, y, map_color(color));
+	STATS_TIMER_STOP(PRIMITIVE_PIXEL);
+}
+
+//Fill a solid rectangle located at (x, y) with specified width, height, and color c
+void fill_rect(int x, int y, int width, int height, color_t c){
+	if(back_buffer){
+		mark_dirty(x, y, width, height);
+	}
+	STATS_PRIMITIVE(PRIMITIVE_FILL_RECT, x, y, width, height);
+
+	STATS_TIMER_START();
+	raster_fill_rect(&screen_bounds, x, y, width, height, map_color(c));
+	STATS_TIMER_STOP(PRIMITIVE_FILL_RECT);
+}
+
+//Draw a horizontal line of length pixels starting at (x, y) and going right
+void draw_hline(int x, int y, int length, color_t c){
+	fill_rect(x, y, length, 1, c);
+}
+
+//Draw a vertical line of length pixels starting at (x, y) and going down
+void draw_vline(int x, int y, int length, color_t c){
+	if(back_buffer){
+		mark_dirty(x, y, 1, length);
+	}
+	STATS_PRIMITIVE(PRIMITIVE_LINE, x, y, 1, length);
+
+	STATS_TIMER_START();
+	raster_vline(&screen_bounds, x, y, length, map_color(c));
+	STATS_TIMER_STOP(PRIMITIVE_LINE);
+}
+
+//Draw a rectangle located at (x, y) with specified height, width, and unsigned 16-bit color
+void draw_rect(int x1, int y1, int width, int height, color_t c){
+	if(back_buffer){
+		mark_dirty(x1, y1, width + 1, height + 1);
+	}
+	STATS_PRIMITIVE(PRIMITIVE_RECT, x1, y1, width + 1, height + 1);
+
+	STATS_TIMER_START();
+	raster_rect(&screen_bounds, x1, y1, width, height, map_color(c));
+	STATS_TIMER_STOP(PRIMITIVE_RECT);
+}
+
+// Lines, circles and polygons ---------------------------------------------
+//
+//Every shape is reduced to horizontal or vertical runs handed to the span
+//writers, and is clipped before any pixel is visited: a line starts its
+//walk at the first pixel inside the clip region, and circles and polygons
+//only visit the rows inside it.
+
+//Draw the part of the line from (x0, y0) to (x1, y1), both ends included, that lies inside clip.
+//Pixel i along the major axis sits floor((2*i*minor + major) / (2*major)) steps along the minor
+//axis, the usual Bresenham choice, so the walk can start at any pixel and still match the unclipped line.
+static void raster_line(const struct bounds* clip, int x0, int y0, int x1, int y1, uint32_t pixel){
+	int x_major = abs(x1 - x0) >= abs(y1 - y0);
+	int m0 = x_major ? x0 : y0; //Start on the major axis
+	int n0 = x_major ? y0 : x0; //Start on the minor axis
+	int major = x_major ? abs(x1 - x0) : abs(y1 - y0); //Steps along the major axis
+	int minor = x_major ? abs(y1 - y0) : abs(x1 - x0); //Steps along the minor axis
+	int m_step = (x_major ? x1 >= x0 : y1 >= y0) ? 1 : -1;
+	int n_step = (x_major ? y1 >= y0 : x1 >= x0) ? 1 : -1;
+	int m_low = x_major ? clip->x1 : clip->y1; //Clip region along each axis, last value included
+	int m_high = (x_major ? clip->x2 : clip->y2) - 1;
+	int n_low = x_major ? clip->y1 : clip->x1;
+	int n_high = (x_major ? clip->y2 : clip->x2) - 1;
+	long long first = 0; //First and last pixel index inside clip
+	long long last = major;
+	long long k_low = 0; //Range of minor-axis steps inside clip
+	long long k_high = minor;
+
+	//Pixel indices whose major coordinate is inside clip
+	if(m_step > 0){
+		if(m_low - m0 > first) first = m_low - m0;
+		if(m_high - m0 < last) last = m_high - m0;
+	} else{
+		if(m0 - m_high > first) first = m0 - m_high;
+		if(m0 - m_low < last) last = m0 - m_low;
+	}
+
+	//Minor-axis steps inside clip
+	if(n_step > 0){
+		if(n_low - n0 > k_low) k_low = n_low - n0;
+		if(n_high - n0 < k_high) k_high = n_high - n0;
+	} else{
+		if(n0 - n_high > k_low) k_low = n0 - n_high;
+		if(n0 - n_low < k_high) k_high = n0 - n_low;
+	}
+
+	if(k_low > k_high){
+		return;
+	}
+
+	//Turn the minor-axis range into pixel indices: step k begins at the first i with 2*i*minor + major >= 2*k*major
+	if(minor > 0){
+		long long two_minor = 2LL * minor;
+		if(k_low > 0){
+			long long start = (2LL*major*k_low - major + two_minor - 1) / two_minor;
+			if(start > first) first = start;
+		}
+		long long end = (2LL*major*(k_high + 1) - major + two_minor - 1) / two_minor - 1;
+		if(end < last) last = end;
+	}
+
+	if(first > last){
+		return;
+	}
+
+	//Where the walk starts: minor step k and the remainder of the rounding division
+	long long numerator = 2LL*first*minor + major;
+	long long two_major = 2LL * (major > 0 ? major : 1);
+	int k = numerator / two_major;
+	long long remainder = numerator % two_major;
+	long long i = first;
+
+	//Emit one run per minor-axis step
+	while(i <= last){
+		long long run_start = i;
+
+		do{ //Walk along the major axis until the minor coordinate changes
+			i++;
+			remainder += 2LL * minor;
+		} while(i <= last && remainder < two_major);
+
+		int run_length = i - run_start;
+		int run_m = m0 + m_step * (m_step > 0 ? run_start : i - 1); //Lowest major coordinate of the run
+		int run_n = n0 + n_step * k;
+
+		if(x_major){
+			backend.fill_span(pixel_address(draw_buffer, run_m, run_n), run_length, pixel);
+		} else{
+			backend.fill_column(pixel_address(draw_buffer, run_n, run_m), run_length, stride, pixel);
+		}
+
+		if(remainder >= two_major){
+			remainder -= two_major;
+			k++;
+		}
+	}
+}
+
+//Integer square root, rounded down
+static int isqrt(long long value){
+	long long root = 0;
+	long long bit = 1LL << 62;
+
+	if(value <= 0){
+		return 0;
+	}
+
+	while(bit > value){
+		bit >>= 2;
+	}
+
+	while(bit != 0){ //Digit-by-digit method, two bits at a time
+		if(value >= root + bit){
+			value -= root + bit;
+			root = (root >> 1) + bit;
+		} else{
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return root;
+}
+
+//Half-width of row dy of a circle of radius r: the farthest column whose center is within r + 1/2 of the center
+static int circle_half_width(int r, int dy){
+	if(dy > r || dy < -r){
+		return -1;
+	}
+
+	return isqrt((long long) r*r + r - (long long) dy*dy);
+}
+
+//Draw the part of a circle of radius r centered on (cx, cy) that lies inside clip; filled, or just its outline.
+//Only rows inside clip are visited, and each contributes one span (filled) or two (outline).
+static void raster_circle(const struct bounds* clip, int cx, int cy, int r, int filled, uint32_t pixel){
+	int first_row = cy - r;
+	int last_row = cy + r;
+	int y = 0;
+
+	if(r < 0 || cx + r < clip->x1 || cx - r >= clip->x2){
+		return;
+	}
+
+	if(first_row < clip->y1) first_row = clip->y1;
+	if(last_row > clip->y2 - 1) last_row = clip->y2 - 1;
+
+	for(y = first_row; y <= last_row; y++){
+		int dy = y - cy;
+		int outer = circle_half_width(r, dy);
+
+		if(filled){
+			raster_fill_rect(clip, cx - outer, y, 2*outer + 1, 1, pixel);
+			continue;
+		}
+
+		//The outline covers the columns the next row out does not reach, and at least the edge pixel
+		int next = circle_half_width(r, dy < 0 ? dy - 1 : dy + 1);
+		int inner = next >= outer ? outer : next + 1;
+
+		if(inner == 0){ //Top or bottom of the circle: one span across the middle
+			raster_fill_rect(clip, cx - outer, y, 2*outer + 1, 1, pixel);
+		} else{
+			raster_fill_rect(clip, cx - outer, y, outer - inner + 1, 1, pixel); //Left side
+			raster_fill_rect(clip, cx + inner, y, outer - inner + 1, 1, pixel); //Right side
+		}
+	}
+}
+
+//One non-horizontal polygon edge; x positions are 32.32 fixed point
+struct polygon_edge{
+	int y_top; //First row the edge is active on
+	int y_bottom; //First row past the edge
+	long long x; //X where the edge crosses the center of the current row
+	long long x_step; //Change in x per row
+};
+
+static int compare_edges(const void* a, const void* b){
+	return ((const struct polygon_edge*) a)->y_top - ((const struct polygon_edge*) b)->y_top;
+}
+
+//a / b rounded toward negative infinity, for b > 0
+static long long floor_div(long long a, long long b){
+	long long quotient = a / b;
+
+	if(a % b != 0 && a < 0){
+		quotient--;
+	}
+
+	return quotient;
+}
+
+//Fill the part of a polygon given as num_points (x, y) pairs that lies inside clip, with the even-odd rule.
+//Edges are sorted by their top row into an edge table; a row's active edges are sorted by x and each
+//pair of them bounds one span.  A pixel is filled when its center is inside the polygon.
+static void raster_polygon(const struct bounds* clip, const int* points, int num_points, uint32_t pixel){
+	struct polygon_edge small_edges[32]; //Enough for most shapes without touching the heap
+	struct polygon_edge* small_active[32];
+	struct polygon_edge* edges = small_edges;
+	struct polygon_edge** active = small_active;
+	int num_edges = 0;
+	int num_active = 0;
+	int next_edge = 0;
+	int top = 0;
+	int bottom = 0;
+	int i = 0;
+	int j = 0;
+	int y = 0;
+
+	if(num_points < 3){
+		return;
+	}
+
+	if(num_points > 32){
+		edges = (struct polygon_edge*) malloc(num_points * (sizeof(struct polygon_edge) + sizeof(struct polygon_edge*)));
+		if(!edges){
+			return;
+		}
+		active = (struct polygon_edge**) (edges + num_points);
+	}
+
+	//Build the edge table
+	top = bottom = points[1];
+	for(i = 0; i < num_points; i++){
+		int ax = points[2*i], ay = points[2*i + 1];
+		int bx = points[2*((i + 1) % num_points)], by = points[2*((i + 1) % num_points) + 1];
+
+		if(ay < top) top = ay;
+		if(ay > bottom) bottom = ay;
+
+		if(ay == by){ //Horizontal edges never cross a row center
+			continue;
+		}
+
+		if(ay > by){ //Make every edge run downward
+			int swap = ax; ax = bx; bx = swap;
+			swap = ay; ay = by; by = swap;
+		}
+
+		struct polygon_edge* edge = &edges[num_edges++];
+		edge->y_top = ay;
+		edge->y_bottom = by;
+		//Rounded down, so a crossing that lands exactly on a pixel center stays on the left of it, as the exact value would
+		edge->x_step = floor_div((long long) (bx - ax) << 32, by - ay);
+		edge->x = ((long long) ax << 32) + floor_div((long long) (bx - ax) << 32, 2LL * (by - ay)); //At the center of row ay
+	}
+
+	qsort(edges, num_edges, sizeof(struct polygon_edge), compare_edges);
+
+	if(top < clip->y1) top = clip->y1;
+	if(bottom > clip->y2) bottom = clip->y2;
+
+	for(y = top; y < bottom; y++){
+		//Move edges that start on or above this row into the active table, catching them up to this row
+		while(next_edge < num_edges && edges[next_edge].y_top <= y){
+			struct polygon_edge* edge = &edges[next_edge++];
+			edge->x += edge->x_step * (y - edge->y_top);
+			active[num_active++] = edge;
+		}
+
+		//Drop edges that have ended, and keep the rest sorted by x (insertion sort; the order barely changes between rows)
+		for(i = 0, j = 0; i < num_active; i++){
+			if(active[i]->y_bottom > y){
+				active[j++] = active[i];
+			}
+		}
+		num_active = j;
+
+		for(i = 1; i < num_active; i++){
+			struct polygon_edge* edge = active[i];
+			for(j = i; j > 0 && active[j - 1]->x > edge->x; j--){
+				active[j] = active[j - 1];
+			}
+			active[j] = edge;
+		}
+
+		//Fill between each pair of crossings: pixels whose centers x + 1/2 fall in [left, right)
+		for(i = 0; i + 1 < num_active; i += 2){
+			int left = (active[i]->x + 0x7fffffffLL) >> 32;
+			int right = (active[i + 1]->x + 0x7fffffffLL) >> 32;
+
+			raster_fill_rect(clip, left, y, right - left, 1, pixel);
+		}
+
+		for(i = 0; i < num_active; i++){
+			active[i]->x += active[i]->x_step;
+		}
+	}
+
+	if(edges != small_edges){
+		free(edges);
+	}
+}
+
+//Draw a line from (x0, y0) to (x1, y1), both ends included
+void draw_line(int x0, int y0, int x1, int y1, color_t c){
+	if(back_buffer){
+		mark_dirty(x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1, abs(x1 - x0) + 1, abs(y1 - y0) + 1);
+	}
+	STATS_PRIMITIVE(PRIMITIVE_LINE, x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1, abs(x1 - x0) + 1, abs(y1 - y0) + 1);
+
+	STATS_TIMER_START();
+	raster_line(&screen_bounds, x0, y0, x1, y1, map_color(c));
+	STATS_TIMER_STOP(PRIMITIVE_LINE);
+}
+
+//Draw the outline of a circle of radius r centered on (cx, cy)
+void draw_circle(int cx, int cy, int r, color_t c){
+	if(back_buffer){
+		mark_dirty(cx - r, cy - r, 2*r + 1, 2*r + 1);
+	}
+	STATS_PRIMITIVE(PRIMITIVE_CIRCLE, cx - r, cy - r, 2*r + 1, 2*r + 1);
+
+	STATS_TIMER_START();
+	raster_circle(&screen_bounds, cx, cy, r, 0, map_color(c));
+	STATS_TIMER_STOP(PRIMITIVE_CIRCLE);
+}
+
+//Draw a solid circle of radius r centered on (cx, cy)
+void fill_circle(int cx, int cy, int r, color_t c){
+	if(back_buffer){
+		mark_dirty(cx - r, cy - r, 2*r + 1, 2*r + 1);
+	}
+	STATS_PRIMITIVE(PRIMITIVE_CIRCLE, cx - r, cy - r, 2*r + 1, 2*r + 1);
+
+	STATS_TIMER_START();
+	raster_circle(&screen_bounds, cx, cy, r, 1, map_color(c));
+	STATS_TIMER_STOP(PRIMITIVE_CIRCLE);
+}
+
+//The bounding box of num_points (x, y) pairs
+static struct bounds points_bounds(const int* points, int num_points){
+	struct bounds area = {0, 0, 0, 0};
+	int i = 0;
+
+	if(num_points <= 0){
+		return area;
+	}
+
+	area.x1 = area.x2 = points[0];
+	area.y1 = area.y2 = points[1];
+	for(i = 1; i < num_points; i++){
+		if(points[2*i] < area.x1) area.x1 = points[2*i];
+		if(points[2*i] > area.x2) area.x2 = points[2*i];
+		if(points[2*i + 1] < area.y1) area.y1 = points[2*i + 1];
+		if(points[2*i + 1] > area.y2) area.y2 = points[2*i + 1];
+	}
+
+	area.x2++;
+	area.y2++;
+
+	return area;
+}
+
+//Fill the polygon whose num_points corners are given as (x, y) pairs in points, with the even-odd rule
+void fill_polygon(const int* points, int num_points, color_t c){
+	struct bounds area = points_bounds(points, num_points);
+
+	if(back_buffer){
+		mark_dirty(area.x1, area.y1, area.x2 - area.x1, area.y2 - area.y1);
+	}
+	STATS_PRIMITIVE(PRIMITIVE_POLYGON, area.x1, area.y1, area.x2 - area.x1, area.y2 - area.y1);
+
+	STATS_TIMER_START();
+	raster_polygon(&screen_bounds, points, num_points, map_color(c));
+	STATS_TIMER_STOP(PRIMITIVE_POLYGON);
+}
+
+// Copying and scrolling ---------------------------------------------------
+//
+//Moving pixels that are already drawn is a row-by-row memmove, which is far
+//cheaper than drawing them again.  A scroll of the whole screen, drawn
+//straight to a display the driver can pan, moves no pixels at all: the
+//display is panned through yres_virtual with FBIOPAN_DISPLAY, and only the
+//rows that scroll into view have to be drawn.
+
+void submit();
+
+//Move height rows of row_bytes bytes from src to dst, each stride bytes apart; the two areas may overlap
+static void move_rows(unsigned char* dst, const unsigned char* src, int row_bytes, int height){
+	int i = 0;
+
+	if(dst > src){ //Moving down: copy the bottom row first so no row is overwritten before it is read
+		for(i = height - 1; i >= 0; i--){
+			memmove(dst + i*stride, src + i*stride, row_bytes);
+		}
+	} else{
+		for(i = 0; i < height; i++){
+			memmove(dst + i*stride, src + i*stride, row_bytes);
+		}
+	}
+}
+
+//Copy the width x height pixels at (src_x, src_y) to (dst_x, dst_y); the source and destination may overlap
+void copy_rect(int src_x, int src_y, int width, int height, int dst_x, int dst_y){
+	int x = src_x;
+	int y = src_y;
+
+	submit(); //Recorded commands must land before their pixels are moved
+	STATS_PRIMITIVE(PRIMITIVE_COPY, dst_x, dst_y, width, height);
+
+	//Only pixels on screen can be copied; trim the destination by the same amount
+	if(!clip_rect(&screen_bounds, &x, &y, &width, &height)){
+		return;
+	}
+	dst_x += x - src_x;
+	dst_y += y - src_y;
+	src_x = x;
+	src_y = y;
+
+	//Only pixels landing on screen need copying; trim the source by the same amount
+	x = dst_x;
+	y = dst_y;
+	if(!clip_rect(&screen_bounds, &x, &y, &width, &height)){
+		return;
+	}
+	src_x += x - dst_x;
+	src_y += y - dst_y;
+	dst_x = x;
+	dst_y = y;
+
+	if(back_buffer){
+		mark_dirty(dst_x, dst_y, width, height);
+	}
+
+	STATS_TIMER_START();
+	move_rows(pixel_address(draw_buffer, dst_x, dst_y), pixel_address(draw_buffer, src_x, src_y), width * backend.bytes_per_pixel, height);
+	STATS_ADD(pixels_written, (long long) width * height);
+	STATS_TIMER_STOP(PRIMITIVE_COPY);
+}
+
+//Scroll the whole screen by dy rows by panning the display; the rows scrolled into view are filled with pixel
+static void pan_scroll(int dy, uint32_t pixel){
+	int visible_rows = screen_bounds.y2;
+	int old_offset = screen_var_info.yoffset;
+	int new_offset = old_offset - dy; //Contents moving up means the window onto yres_virtual moves down
+	int kept_rows = visible_rows - (dy < 0 ? -dy : dy); //Rows that stay on screen
+
+	if(new_offset < 0 || new_offset + visible_rows > (int) screen_var_info.yres_virtual){
+		//The window would leave yres_virtual: wrap to the other end, carrying the rows that stay on screen along.
+		//This is one copy every (yres_virtual - yres) / |dy| scrolls instead of one per scroll.
+		int src_row = dy < 0 ? old_offset - dy : old_offset;
+
+		new_offset = dy < 0 ? 0 : screen_var_info.yres_virtual - visible_rows;
+		int dst_row = dy < 0 ? new_offset : new_offset + dy;
+
+		memmove(pixel_address(framebuffer, 0, dst_row), pixel_address(framebuffer, 0, src_row), kept_rows * stride);
+	}
+
+	screen_var_info.yoffset = new_offset;
+	ioctl(framebuffer_desc, FBIOPAN_DISPLAY, &screen_var_info);
+
+	display_origin = pixel_address(framebuffer, screen_var_info.xoffset, new_offset);
+	draw_buffer = display_origin;
+
+	if(dy < 0){ //New rows came in at the bottom
+		raster_fill_rect(&screen_bounds, 0, kept_rows, screen_bounds.x2, -dy, pixel);
+	} else{ //New rows came in at the top
+		raster_fill_rect(&screen_bounds, 0, 0, screen_bounds.x2, dy, pixel);
+	}
+}
+
+//Scroll the contents of the width x height region at (x, y) by dy rows (negative scrolls up, as a log view does).
+//Rows scrolled into the region are filled with color c.
+void scroll_region(int x, int y, int width, int height, int dy, color_t c){
+	uint32_t pixel = map_color(c);
+
+	submit(); //Recorded commands must land before their pixels are moved
+	STATS_PRIMITIVE(PRIMITIVE_COPY, x, y, width, height);
+
+	if(!clip_rect(&screen_bounds, &x, &y, &width, &height)){
+		return;
+	}
+
+	if(dy >= height || -dy >= height){ //Everything scrolls out; the region is already clipped and counted, so fill it directly
+		if(back_buffer){
+			mark_dirty(x, y, width, height);
+		}
+		STATS_TIMER_START();
+		raster_fill_rect(&screen_bounds, x, y, width, height, pixel);
+		STATS_TIMER_STOP(PRIMITIVE_COPY);
+		return;
+	}
+
+	if(dy == 0){
+		return;
+	}
+
+	if(can_pan && !back_buffer && x == screen_bounds.x1 && y == screen_bounds.y1 && width == screen_bounds.x2 && height == screen_bounds.y2){
+		pan_scroll(dy, pixel);
+		return;
+	}
+
+	if(back_buffer){
+		mark_dirty(x, y, width, height);
+	}
+
+	STATS_TIMER_START();
+	if(dy < 0){ //Contents move up; new rows come in at the bottom
+		move_rows(pixel_address(draw_buffer, x, y), pixel_address(draw_buffer, x, y - dy), width * backend.bytes_per_pixel, height + dy);
+		raster_fill_rect(&screen_bounds, x, y + height + dy, width, -dy, pixel);
+	} else{ //Contents move down; new rows come in at the top
+		move_rows(pixel_address(draw_buffer, x, y + dy), pixel_address(draw_buffer, x, y), width * backend.bytes_per_pixel, height - dy);
+		raster_fill_rect(&screen_bounds, x, y, width, dy, pixel);
+	}
+	STATS_ADD(pixels_written, (long long) width * (height - (dy < 0 ? -dy : dy))); //The moved rows; the fill counts itself
+	STATS_TIMER_STOP(PRIMITIVE_COPY);
+}
+
+// Text ------------------------------------------------------------------
+//
+//Each iso_font glyph row is 8 bits (least significant bit = leftmost pixel).
+//Rather than testing all 128 bits of a glyph on every draw, each row is
+//expanded once into the runs of consecutive set pixels it contains.  The
+//runs do not depend on the color, so one expansion serves every color.
+
+#define GLYPH_WIDTH 8
+#define GLYPH_HEIGHT 16
+#define MAX_RUNS_PER_ROW 4 //8 pixels can hold at most 4 separate runs
+
+//The runs of set pixels in one row of a glyph
+struct glyph_row{
+	unsigned char num_runs;
+	unsigned char start[MAX_RUNS_PER_ROW]; //Column the run starts at
+	unsigned char length[MAX_RUNS_PER_ROW]; //Number of pixels in the run
+};
+
+struct glyph_row glyph_cache[256][GLYPH_HEIGHT];
+int glyph_cache_ready; //Set once glyph_cache has been built from iso_font
+
+//Expand every iso_font glyph into its per-row runs
+static void build_glyph_cache(){
+	int ch = 0;
+	int i = 0;
+	int j = 0;
+
+	for(ch = 0; ch < 256; ch++){
+		for(i = 0; i < GLYPH_HEIGHT; i++){
+			int curr_row = iso_font[ch*GLYPH_HEIGHT + i];
+			struct glyph_row* row = &glyph_cache[ch][i];
+
+			row->num_runs = 0;
+			for(j = 0; j < GLYPH_WIDTH; j++){
+				if(!(curr_row & (1 << j))){
+					continue;
+				}
+
+				if(j > 0 && (curr_row & (1 << (j - 1)))){ //Continues the run started by the pixel to the left
+					row->length[row->num_runs - 1]++;
+				} else{ //Start a new run
+					row->start[row->num_runs] = j;
+					row->length[row->num_runs] = 1;
+					row->num_runs++;
+				}
+			}
+		}
+	}
+
+	glyph_cache_ready = 1;
+}
+
+//Draw the part of count characters of text starting at (x, y) that lies inside clip.
+//The string is clipped once and then drawn one screen row at a time, so each row of the framebuffer is touched once per string rather than once per glyph.
+static void raster_glyphs(const struct bounds* clip, int x, int y, const unsigned char* text, int count, uint32_t pixel){
+	int width = count * GLYPH_WIDTH;
+	int height = GLYPH_HEIGHT;
+	int clip_x = x;
+	int clip_y = y;
+
+	if(!clip_rect(clip, &clip_x, &clip_y, &width, &height)){
+		return;
+	}
+
+	int clip_x2 = clip_x + width; //One past the last visible column
+	int first_char = (clip_x - x) / GLYPH_WIDTH; //Characters entirely left of the screen are skipped
+	int last_char = (clip_x2 - 1 - x) / GLYPH_WIDTH; //As are characters entirely right of it
+	unsigned char* row = pixel_address(draw_buffer, 0, clip_y);
+	int bytes_per_pixel = backend.bytes_per_pixel;
+	int i = 0;
+	int k = 0;
+	int r = 0;
+
+	for(i = clip_y - y; i < (clip_y - y) + height; i++){ //Glyph row i of every character lands on the same screen row
+		for(k = first_char; k <= last_char; k++){
+			const struct glyph_row* runs = &glyph_cache[text[k]][i];
+			int glyph_x = x + k*GLYPH_WIDTH;
+
+			for(r = 0; r < runs->num_runs; r++){
+				int run_x = glyph_x + runs->start[r];
+				int run_x2 = run_x + runs->length[r];
+
+				if(run_x < clip_x) run_x = clip_x; //Only the first and last characters can actually be clipped
+				if(run_x2 > clip_x2) run_x2 = clip_x2;
+
+				if(run_x < run_x2){
+					backend.fill_span(row + run_x*bytes_per_pixel, run_x2 - run_x, pixel);
+				}
+			}
+		}
+
+		row += stride;
+	}
+}
+
+//Draw count characters of text at (x, y) with color c
+static void draw_glyphs(int x, int y, const unsigned char* text, int count, color_t c){
+	if(!glyph_cache_ready){
+		build_glyph_cache();
+	}
+
+	if(back_buffer){
+		mark_dirty(x, y, count * GLYPH_WIDTH, GLYPH_HEIGHT);
+	}
+	STATS_PRIMITIVE(PRIMITIVE_TEXT, x, y, count * GLYPH_WIDTH, GLYPH_HEIGHT);
+
+	STATS_TIMER_START();
+	raster_glyphs(&screen_bounds, x, y, text, count, map_color(c));
+	STATS_TIMER_STOP(PRIMITIVE_TEXT);
+}
+
+//Draw a given character found in the iso_font array with given color c at location (x, y)
+void draw_char(int x, int y, const char character, color_t c){
+	draw_glyphs(x, y, (const unsigned char*) &character, 1, c);
+}
+
+//Draw a given piece of text onto the display at location (x, y) and color c
+void draw_text(int x, int y, const char* text, color_t c){
+	int length = 0;
+
+	while(text[length] != '\0'){ //Find the length so the whole string can be clipped and drawn in one pass
+		length++;
+	}
+
+	draw_glyphs(x, y, (const unsigned char*) text, length, c);
+}
+
+// Blending ----------------------------------------------------------------
+//
+//Source-over blending: each destination pixel becomes alpha/255 of the
+//color plus the rest of what was there.  alpha can also be scaled per
+//pixel by an 8-bit coverage mask, which is what anti-aliased text is drawn
+//with.  The anti-aliased glyphs are built once from iso_font by scaling
+//each glyph up 2x with Scale2x (which cuts corners off diagonal steps and
+//fills in the notches between them) and averaging every 2x2 block back down
+//to one pixel, so the edges of a stroke get 1/4, 1/2 or 3/4 coverage.
+
+unsigned char glyph_coverage[256][GLYPH_HEIGHT][GLYPH_WIDTH];
+int glyph_coverage_ready; //Set once glyph_coverage has been built from iso_font
+
+//Whether pixel (j, i) of a glyph is set; anything outside the 8x16 cell is not
+static int glyph_bit(int ch, int i, int j){
+	if(i < 0 || i >= GLYPH_HEIGHT || j < 0 || j >= GLYPH_WIDTH){
+		return 0;
+	}
+
+	return (iso_font[ch*GLYPH_HEIGHT + i] >> j) & 1;
+}
+
+//Build the coverage mask of every iso_font glyph
+static void build_glyph_coverage(){
+	int ch = 0;
+	int i = 0;
+	int j = 0;
+
+	for(ch = 0; ch < 256; ch++){
+		for(i = 0; i < GLYPH_HEIGHT; i++){
+			for(j = 0; j < GLYPH_WIDTH; j++){
+				int pixel = glyph_bit(ch, i, j);
+				int up = glyph_bit(ch, i - 1, j), down = glyph_bit(ch, i + 1, j);
+				int left = glyph_bit(ch, i, j - 1), right = glyph_bit(ch, i, j + 1);
+				int covered = 0;
+
+				//The four quarters of the pixel, as Scale2x would draw them
+				covered += (left == up && left != down && up != right) ? up : pixel; //Top left
+				covered += (up == right && up != left && right != down) ? right : pixel; //Top right
+				covered += (down == left && down != right && left != up) ? left : pixel; //Bottom left
+				covered += (right == down && right != up && down != left) ? down : pixel; //Bottom right
+
+				glyph_coverage[ch][i][j] = covered * 255 / 4;
+			}
+		}
+	}
+
+	glyph_coverage_ready = 1;
+}
+
+//Blend pixel at alpha over the part of a rectangle that lies inside clip
+static void raster_blend_rect(const struct bounds* clip, int x, int y, int width, int height, uint32_t pixel, int alpha){
+	if(!clip_rect(clip, &x, &y, &width, &height)){
+		return;
+	}
+
+	unsigned char* row = pixel_address(draw_buffer, x, y);
+	int i = 0;
+
+	for(i = 0; i < height; i++){
+		backend.blend_span(row, NULL, width, pixel, alpha);
+		row += stride;
+	}
+}
+
+//Blend pixel over the part of a width x height coverage mask at (x, y) that lies inside clip; rows of the mask are mask_stride bytes apart
+static void raster_blend_mask(const struct bounds* clip, int x, int y, int width, int height, const unsigned char* mask, int mask_stride, uint32_t pixel, int alpha){
+	int clip_x = x;
+	int clip_y = y;
+
+	if(!clip_rect(clip, &clip_x, &clip_y, &width, &height)){
+		return;
+	}
+
+	unsigned char* row = pixel_address(draw_buffer, clip_x, clip_y);
+	const unsigned char* mask_row = mask + (clip_y - y) * mask_stride + (clip_x - x);
+	int i = 0;
+
+	for(i = 0; i < height; i++){
+		backend.blend_span(row, mask_row, width, pixel, alpha);
+		row += stride;
+		mask_row += mask_stride;
+	}
+}
+
+//Blend the part of count anti-aliased characters of text at (x, y) that lies inside clip, one screen row at a time like raster_glyphs()
+static void raster_glyphs_aa(const struct bounds* clip, int x, int y, const unsigned char* text, int count, uint32_t pixel, int alpha){
+	int width = count * GLYPH_WIDTH;
+	int height = GLYPH_HEIGHT;
+	int clip_x = x;
+	int clip_y = y;
+
+	if(!clip_rect(clip, &clip_x, &clip_y, &width, &height)){
+		return;
+	}
+
+	int clip_x2 = clip_x + width;
+	unsigned char* row = pixel_address(draw_buffer, 0, clip_y);
+	int bytes_per_pixel = backend.bytes_per_pixel;
+	int i = 0;
+	int k = 0;
+
+	for(i = clip_y - y; i < (clip_y - y) + height; i++){
+		for(k = (clip_x - x) / GLYPH_WIDTH; k <= (clip_x2 - 1 - x) / GLYPH_WIDTH; k++){
+			int glyph_x = x + k*GLYPH_WIDTH;
+			int span_x = glyph_x < clip_x ? clip_x : glyph_x;
+			int span_x2 = glyph_x + GLYPH_WIDTH > clip_x2 ? clip_x2 : glyph_x + GLYPH_WIDTH;
+
+			backend.blend_span(row + span_x*bytes_per_pixel, glyph_coverage[text[k]][i] + (span_x - glyph_x), span_x2 - span_x, pixel, alpha);
+		}
+
+		row += stride;
+	}
+}
+
+//Blend a rectangle of color c over what is already on screen; alpha runs from 0 (invisible) to 255 (opaque)
+void blend_rect(int x, int y, int width, int height, color_t c, int alpha){
+	if(alpha <= 0){
+		return;
+	}
+	if(alpha >= 255){ //Opaque is a plain fill, which does not need to read the destination
+		fill_rect(x, y, width, height, c);
+		return;
+	}
+
+	if(back_buffer){
+		mark_dirty(x, y, width, height);
+	}
+	STATS_PRIMITIVE(PRIMITIVE_BLEND, x, y, width, height);
+
+	STATS_TIMER_START();
+	raster_blend_rect(&screen_bounds, x, y, width, height, map_color(c), alpha);
+	STATS_TIMER_STOP(PRIMITIVE_BLEND);
+}
+
+//Blend color c over a width x height rectangle at (x, y), each pixel weighted by alpha and its byte of mask (0 to 255);
+//rows of mask are mask_stride bytes apart
+void blend_mask(int x, int y, int width, int height, const unsigned char* mask, int mask_stride, color_t c, int alpha){
+	if(alpha <= 0){
+		return;
+	}
+
+	if(back_buffer){
+		mark_dirty(x, y, width, height);
+	}
+	STATS_PRIMITIVE(PRIMITIVE_BLEND, x, y, width, height);
+
+	STATS_TIMER_START();
+	raster_blend_mask(&screen_bounds, x, y, width, height, mask, mask_stride, map_color(c), alpha > 255 ? 255 : alpha);
+	STATS_TIMER_STOP(PRIMITIVE_BLEND);
+}
+
+//Draw anti-aliased text at (x, y) with color c, blended at alpha over what is already on screen
+void draw_text_aa(int x, int y, const char* text, color_t c, int alpha){
+	int length = strlen(text);
+
+	if(alpha <= 0){
+		return;
+	}
+	if(!glyph_coverage_ready){
+		build_glyph_coverage();
+	}
+
+	if(back_buffer){
+		mark_dirty(x, y, length * GLYPH_WIDTH, GLYPH_HEIGHT);
+	}
+	STATS_PRIMITIVE(PRIMITIVE_TEXT, x, y, length * GLYPH_WIDTH, GLYPH_HEIGHT);
+
+	STATS_TIMER_START();
+	raster_glyphs_aa(&screen_bounds, x, y, (const unsigned char*) text, length, map_color(c), alpha > 255 ? 255 : alpha);
+	STATS_TIMER_STOP(PRIMITIVE_TEXT);
+}
+
+// Sprites -----------------------------------------------------------------
+//
+//A sprite is a bitmap converted once, when it is loaded, to the
+//framebuffer's native format and stored with rows aligned to 16 bytes, so
+//drawing it is one memcpy per visible row.  Load sprites after
+//init_graphics(), once the native format is known.
+//
+//Giving a sprite a color key run-length encodes it: each row becomes a list
+//of (skip, length) pairs, where skip counts transparent pixels to step over
+//and length counts opaque pixels to copy.  Drawing a keyed sprite never
+//reads or writes the transparent pixels, and never compares a pixel
+//against the key; the runs are just clipped and copied.
+
+#define SPRITE_ROW_ALIGN 16 //Rows start on this many bytes so wide copies stay aligned
+
+struct sprite_run{
+	unsigned short skip; //Transparent pixels before the run
+	unsigned short length; //Opaque pixels in the run
+};
+
+struct sprite{
+	int width, height;
+	int pitch; //Bytes from one row of pixels to the next
+	unsigned char* pixels; //Native pixels, 16-byte aligned
+	struct sprite_run* runs; //NULL unless the sprite has a color key
+	int* row_runs; //runs[row_runs[i]] through runs[row_runs[i+1] - 1] make up row i
+};
+
+//Create a sprite from width x height RGB565 pixels, row by row; returns NULL if it cannot be allocated
+struct sprite* create_sprite(int width, int height, const color_t* pixels){
+	struct sprite* sprite = NULL;
+	int bytes_per_pixel = backend.bytes_per_pixel;
+	int i = 0;
+	int j = 0;
+
+	if(width <= 0 || height <= 0 || width > 65535){ //Runs count pixels in 16 bits
+		return NULL;
+	}
+
+	sprite = calloc(1, sizeof(struct sprite));
+	if(!sprite){
+		return NULL;
+	}
+
+	sprite->width = width;
+	sprite->height = height;
+	sprite->pitch = (width * bytes_per_pixel + SPRITE_ROW_ALIGN - 1) & ~(SPRITE_ROW_ALIGN - 1);
+	if(posix_memalign((void**) &sprite->pixels, SPRITE_ROW_ALIGN, (size_t) sprite->pitch * height)){
+		free(sprite);
+		return NULL;
+	}
+
+	for(i = 0; i < height; i++){ //Convert to native pixels with the span writers, one pixel at a time
+		unsigned char* row = sprite->pixels + i * sprite->pitch;
+
+		for(j = 0; j < width; j++){
+			backend.fill_span(row + j * bytes_per_pixel, 1, map_color(pixels[i * width + j]));
+		}
+	}
+
+	return sprite;
+}
+
+//Free a sprite and its runs
+void free_sprite(struct sprite* sprite){
+	if(!sprite){
+		return;
+	}
+
+	free(sprite->runs);
+	free(sprite->row_runs);
+	free(sprite->pixels);
+	free(sprite);
+}
+
+//Make every pixel of color key transparent by encoding the sprite's rows as runs.
+//Returns 0 if the runs could not be allocated, in which case the sprite stays opaque.
+int set_sprite_key(struct sprite* sprite, color_t key){
+	int bytes_per_pixel = backend.bytes_per_pixel;
+	uint32_t native_key = map_color(key);
+	int max_runs = sprite->height * ((sprite->width + 1) / 2); //A row alternating opaque and transparent pixels has the most
+	struct sprite_run* runs = malloc(max_runs * sizeof(struct sprite_run));
+	int* row_runs = malloc((sprite->height + 1) * sizeof(int));
+	int num_runs = 0;
+	int i = 0;
+
+	if(!runs || !row_runs){
+		free(runs);
+		free(row_runs);
+		return 0;
+	}
+
+	for(i = 0; i < sprite->height; i++){
+		unsigned char* row = sprite->pixels + i * sprite->pitch;
+		int j = 0;
+
+		row_runs[i] = num_runs;
+		while(j < sprite->width){
+			int start = j;
+			uint32_t pixel = 0;
+
+			for(; j < sprite->width; j++){ //Step over transparent pixels
+				memcpy(&pixel, row + j * bytes_per_pixel, bytes_per_pixel);
+				if(pixel != native_key){
+					break;
+				}
+			}
+			if(j == sprite->width){ //Trailing transparent pixels need no run
+				break;
+			}
+
+			runs[num_runs].skip = j - start;
+			for(start = j; j < sprite->width; j++){ //Then take the opaque ones
+				memcpy(&pixel, row + j * bytes_per_pixel, bytes_per_pixel);
+				if(pixel == native_key){
+					break;
+				}
+			}
+			runs[num_runs].length = j - start;
+			num_runs++;
+		}
+	}
+	row_runs[sprite->height] = num_runs;
+
+	struct sprite_run* shrunk = realloc(runs, (num_runs ? num_runs : 1) * sizeof(struct sprite_run)); //Give back what the worst case reserved
+	free(sprite->runs);
+	free(sprite->row_runs);
+	sprite->runs = shrunk ? shrunk : runs;
+	sprite->row_runs = row_runs;
+
+	return 1;
+}
+
+//Read a whole file into memory; returns NULL on failure
+static unsigned char* read_file(const char* path, size_t* size){
+	struct stat info;
+	unsigned char* data = NULL;
+	size_t done = 0;
+	int fd = open(path, O_RDONLY);
+
+	if(fd < 0){
+		return NULL;
+	}
+
+	if(fstat(fd, &info) == 0 && info.st_size > 0){
+		data = malloc(info.st_size);
+	}
+
+	while(data && done < (size_t) info.st_size){
+		ssize_t got = read(fd, data + done, info.st_size - done);
+
+		if(got < 0 && errno == EINTR){
+			continue;
+		}
+		if(got <= 0){ //Error or the file shrank underneath us
+			free(data);
+			data = NULL;
+			break;
+		}
+		done += got;
+	}
+
+	close(fd);
+	*size = done;
+
+	return data;
+}
+
+//Load a file of width x height little-endian RGB565 pixels with no header; returns NULL on failure
+struct sprite* load_sprite_raw(const char* path, int width, int height){
+	size_t size = 0;
+	unsigned char* data = read_file(path, &size);
+	struct sprite* sprite = NULL;
+
+	if(data && width > 0 && height > 0 && size >= (size_t) width * height * sizeof(color_t)){
+		sprite = create_sprite(width, height, (const color_t*) data);
+	}
+
+	free(data);
+
+	return sprite;
+}
+
+//Little-endian fields of a BMP header
+static uint32_t read_le(const unsigned char* data, int bytes){
+	uint32_t value = 0;
+
+	while(bytes-- > 0){
+		value = (value << 8) | data[bytes];
+	}
+
+	return value;
+}
+
+//Load an uncompressed 16, 24 or 32-bit BMP; returns NULL on failure or for any other kind of BMP
+struct sprite* load_sprite_bmp(const char* path){
+	size_t size = 0;
+	unsigned char* data = read_file(path, &size);
+	struct sprite* sprite = NULL;
+	color_t* pixels = NULL;
+	int i = 0;
+	int j = 0;
+
+	if(!data || size < 54 || data[0] != 'B' || data[1] != 'M'){
+		free(data);
+		return NULL;
+	}
+
+	uint32_t offset = read_le(data + 10, 4);
+	int width = (int32_t) read_le(data + 18, 4);
+	int height = (int32_t) read_le(data + 22, 4);
+	int bits = read_le(data + 28, 2);
+	uint32_t compression = read_le(data + 30, 4);
+	int top_down = height < 0; //Rows are stored bottom-up unless the height is negative
+	int green_bits = 5; //16-bit BMPs are 555 unless their bitfields say 565
+
+	if(top_down){
+		height = -height;
+	}
+	if(compression == 3 && size >= 66){ //BI_BITFIELDS: red, green and blue masks follow the 40-byte info header
+		uint32_t red_mask = read_le(data + 54, 4), green_mask = read_le(data + 58, 4), blue_mask = read_le(data + 62, 4);
+
+		if(bits == 16 && green_mask == 0x07e0){
+			green_bits = 6;
+		} else if(!(bits == 16 && green_mask == 0x03e0) && !(bits == 32 && red_mask == 0xff0000 && green_mask == 0xff00 && blue_mask == 0xff)){
+			bits = 0; //A layout the conversion below does not handle
+		}
+	} else if(compression != 0){ //Anything else must be BI_RGB
+		bits = 0;
+	}
+
+	size_t row_bytes = ((size_t) width * bits / 8 + 3) & ~(size_t) 3; //Rows are padded to 4 bytes
+	if((bits != 16 && bits != 24 && bits != 32) || width <= 0 || height <= 0 || offset + row_bytes * height > size){
+		free(data);
+		return NULL;
+	}
+
+	pixels = malloc((size_t) width * height * sizeof(color_t));
+	for(i = 0; pixels && i < height; i++){
+		const unsigned char* row = data + offset + row_bytes * (top_down ? i : height - 1 - i);
+
+		for(j = 0; j < width; j++){
+			color_t c = 0;
+
+			if(bits == 16){
+				uint32_t value = read_le(row + j*2, 2);
+				c = green_bits == 6 ? value : ((value & 0x7fe0) << 1) | ((value >> 4) & 0x20) | (value & 0x1f); //Widen 555 green to 6 bits
+			} else{ //Blue, green, red (and unused) bytes
+				const unsigned char* p = row + j * (bits / 8);
+				c = ((p[2] >> 3) << 11) | ((p[1] >> 2) << 5) | (p[0] >> 3);
+			}
+			pixels[i * width + j] = c;
+		}
+	}
+
+	if(pixels){
+		sprite = create_sprite(width, height, pixels);
+	}
+
+	free(pixels);
+	free(data);
+
+	return sprite;
+}
+
+//Draw the part of sprite at (x, y) that lies inside clip
+static void raster_sprite(const struct bounds* clip, int x, int y, const struct sprite* sprite){
+	int width = sprite->width;
+	int height = sprite->height;
+	int clip_x = x;
+	int clip_y = y;
+
+	if(!clip_rect(clip, &clip_x, &clip_y, &width, &height)){
+		return;
+	}
+
+	int bytes_per_pixel = backend.bytes_per_pixel;
+	int first_column = clip_x - x; //Columns of the sprite that are visible
+	int last_column = first_column + width;
+	unsigned char* dst = pixel_address(draw_buffer, clip_x, clip_y); //Where the first visible column lands
+	const unsigned char* src = sprite->pixels + (clip_y - y) * sprite->pitch + first_column * bytes_per_pixel;
+	int i = 0;
+
+	if(!sprite->runs){ //Opaque: one copy per row
+		for(i = 0; i < height; i++){
+			memcpy(dst, src, width * bytes_per_pixel);
+			STATS_ADD(pixels_written, width);
+			dst += stride;
+			src += sprite->pitch;
+		}
+		return;
+	}
+
+	for(i = clip_y - y; i < (clip_y - y) + height; i++){ //Keyed: copy the opaque runs, clipped to the visible columns
+		const struct sprite_run* run = sprite->runs + sprite->row_runs[i];
+		const struct sprite_run* end = sprite->runs + sprite->row_runs[i + 1];
+		int column = 0;
+
+		for(; run < end && column < last_column; run++){
+			int start = column + run->skip;
+			int stop = start + run->length;
+
+			column = stop;
+			if(start < first_column) start = first_column;
+			if(stop > last_column) stop = last_column;
+
+			if(start < stop){
+				int offset = (start - first_column) * bytes_per_pixel;
+				memcpy(dst + offset, src + offset, (stop - start) * bytes_per_pixel);
+				STATS_ADD(pixels_written, stop - start);
+			}
+		}
+
+		dst += stride;
+		src += sprite->pitch;
+	}
+}
+
+//Draw sprite with its top-left corner at (x, y); pixels of its color key, if it has one, are left untouched
+void draw_sprite(int x, int y, const struct sprite* sprite){
+	if(!sprite){
+		return;
+	}
+
+	if(back_buffer){
+		mark_dirty(x, y, sprite->width, sprite->height);
+	}
+	STATS_PRIMITIVE(PRIMITIVE_SPRITE, x, y, sprite->width, sprite->height);
+
+	STATS_TIMER_START();
+	raster_sprite(&screen_bounds, x, y, sprite);
+	STATS_TIMER_STOP(PRIMITIVE_SPRITE);
+}
+
+// Command lists -----------------------------------------------------------
+//
+//Instead of drawing right away, the record_* calls append a compact command
+//(with its color already converted) to a list.  submit() buckets the list
+//by the horizontal bands of the screen each command covers, then draws one
+//band at a time with every command clipped to that band, so the band stays
+//in cache while all of its commands run.  Within a band, commands still run
+//in the order they were recorded.
+
+#ifndef BAND_BYTES
+#define BAND_BYTES 65536 //Target size of one band of the draw buffer; small enough to stay in L2
+#endif
+#define BANDS_PER_THREAD 4 //With raster threads, cut the frame into at least this many bands per thread so none sits idle
+
+enum command_type{
+	COMMAND_PIXEL,
+	COMMAND_FILL_RECT,
+	COMMAND_RECT,
+	COMMAND_VLINE,
+	COMMAND_TEXT,
+	COMMAND_LINE,
+	COMMAND_CIRCLE,
+	COMMAND_FILL_CIRCLE,
+	COMMAND_POLYGON,
+	COMMAND_BLEND_RECT,
+	COMMAND_TEXT_AA
+};
+
+struct draw_command{
+	int type;
+	int x, y;
+	int width, height; //For COMMAND_VLINE the length is in height; for COMMAND_TEXT and COMMAND_POLYGON width is the number of characters or points;
+	                   //for COMMAND_LINE they are the far end; for the circles width is the radius
+	int data_offset; //Where a COMMAND_TEXT or COMMAND_TEXT_AA's characters start in command_text, or a COMMAND_POLYGON's points in command_points
+	uint32_t pixel; //Native pixel value, converted once when the command is recorded
+	int alpha; //For the blending commands, 0 to 255
+};
+
+struct draw_command* commands; //The list being recorded
+int num_commands;
+int commands_capacity;
+unsigned char* command_text; //Characters of every COMMAND_TEXT in the list, back to back
+int command_text_used;
+int command_text_capacity;
+int* command_points; //(x, y) pairs of every COMMAND_POLYGON in the list, back to back
+int command_points_used; //Ints, not points
+int command_points_capacity;
+int* band_start; //band_entries[band_start[b]] through band_entries[band_start[b+1] - 1] are the commands touching band b
+int band_start_capacity;
+int* band_entries; //Command indices, grouped by band
+int band_entries_capacity;
+
+//Make sure *array has room for needed elements of element_size bytes, growing it geometrically
+//Returns 0 if the memory could not be allocated
+static int reserve(void** array, int* capacity, int needed, size_t element_size){
+	if(needed <= *capacity){
+		return 1;
+	}
+
+	int new_capacity = *capacity ? *capacity : 64;
+	while(new_capacity < needed){
+		new_capacity *= 2;
+	}
+
+	void* grown = realloc(*array, new_capacity * element_size);
+	if(!grown){
+		return 0;
+	}
+
+	*array = grown;
+	*capacity = new_capacity;
+
+	return 1;
+}
+
+//The region a command can touch, before any clipping
+static struct bounds command_bounds(const struct draw_command* command){
+	struct bounds area = {command->x, command->y, command->x + command->width, command->y + command->height};
+
+	switch(command->type){
+		case COMMAND_PIXEL:
+			area.x2 = command->x + 1;
+			area.y2 = command->y + 1;
+			break;
+		case COMMAND_RECT: //The outline includes its far edges
+			area.x2++;
+			area.y2++;
+			break;
+		case COMMAND_VLINE:
+			area.x2 = command->x + 1;
+			break;
+		case COMMAND_TEXT:
+		case COMMAND_TEXT_AA:
+			area.x2 = command->x + command->width * GLYPH_WIDTH;
+			area.y2 = command->y + GLYPH_HEIGHT;
+			break;
+		case COMMAND_LINE:
+			area.x1 = command->x < command->width ? command->x : command->width;
+			area.y1 = command->y < command->height ? command->y : command->height;
+			area.x2 = (command->x > command->width ? command->x : command->width) + 1;
+			area.y2 = (command->y > command->height ? command->y : command->height) + 1;
+			break;
+		case COMMAND_CIRCLE:
+		case COMMAND_FILL_CIRCLE:
+			area.x1 = command->x - command->width;
+			area.y1 = command->y - command->width;
+			area.x2 = command->x + command->width + 1;
+			area.y2 = command->y + command->width + 1;
+			break;
+		case COMMAND_POLYGON:
+			area = points_bounds(command_points + command->data_offset, command->width);
+			break;
+	}
+
+	return area;
+}
+
+#ifdef GRAPHICS_STATS
+//The kind of primitive each command is counted as
+const int command_primitives[] = {
+	[COMMAND_PIXEL] = PRIMITIVE_PIXEL,
+	[COMMAND_FILL_RECT] = PRIMITIVE_FILL_RECT,
+	[COMMAND_RECT] = PRIMITIVE_RECT,
+	[COMMAND_VLINE] = PRIMITIVE_LINE,
+	[COMMAND_TEXT] = PRIMITIVE_TEXT,
+	[COMMAND_LINE] = PRIMITIVE_LINE,
+	[COMMAND_CIRCLE] = PRIMITIVE_CIRCLE,
+	[COMMAND_FILL_CIRCLE] = PRIMITIVE_CIRCLE,
+	[COMMAND_POLYGON] = PRIMITIVE_POLYGON,
+	[COMMAND_BLEND_RECT] = PRIMITIVE_BLEND,
+	[COMMAND_TEXT_AA] = PRIMITIVE_TEXT
+};
+#endif
+
+//Draw the part of one command that lies inside clip
+static void run_command(const struct bounds* clip, const struct draw_command* command){
+	STATS_TIMER_START();
+
+	switch(command->type){
+		case COMMAND_PIXEL:
+			raster_pixel(clip, command->x, command->y, command->pixel);
+			break;
+		case COMMAND_FILL_RECT:
+			raster_fill_rect(clip, command->x, command->y, command->width, command->height, command->pixel);
+			break;
+		case COMMAND_RECT:
+			raster_rect(clip, command->x, command->y, command->width, command->height, command->pixel);
+			break;
+		case COMMAND_VLINE:
+			raster_vline(clip, command->x, command->y, command->height, command->pixel);
+			break;
+		case COMMAND_TEXT:
+			raster_glyphs(clip, command->x, command->y, command_text + command->data_offset, command->width, command->pixel);
+			break;
+		case COMMAND_LINE:
+			raster_line(clip, command->x, command->y, command->width, command->height, command->pixel);
+			break;
+		case COMMAND_CIRCLE:
+		case COMMAND_FILL_CIRCLE:
+			raster_circle(clip, command->x, command->y, command->width, command->type == COMMAND_FILL_CIRCLE, command->pixel);
+			break;
+		case COMMAND_POLYGON:
+			raster_polygon(clip, command_points + command->data_offset, command->width, command->pixel);
+			break;
+		case COMMAND_BLEND_RECT:
+			raster_blend_rect(clip, command->x, command->y, command->width, command->height, command->pixel, command->alpha);
+			break;
+		case COMMAND_TEXT_AA:
+			raster_glyphs_aa(clip, command->x, command->y, command_text + command->data_offset, command->width, command->pixel, command->alpha);
+			break;
+	}
+
+	STATS_TIMER_STOP(command_primitives[command->type]);
+}
+
+//Draw band b, rows b*band_rows up to (b+1)*band_rows, with every command that touches it clipped to it
+static void draw_band(int b, int band_rows){
+	struct bounds band = {screen_bounds.x1, b * band_rows, screen_bounds.x2, (b + 1) * band_rows};
+	int i = 0;
+
+	if(band.y2 > screen_bounds.y2){
+		band.y2 = screen_bounds.y2;
+	}
+
+	for(i = band_start[b]; i < band_start[b + 1]; i++){
+		run_command(&band, &commands[band_entries[i]]);
+	}
+}
+
+static void draw_bands(int band_rows, int num_bands);
+extern int num_raster_workers;
+
+//Draw every recorded command, band by band, and empty the list
+void submit(){
+	int band_rows = stride > 0 ? BAND_BYTES / stride : 1; //Rows per band
+	int i = 0;
+	int b = 0;
+
+	if(num_commands == 0){
+		return;
+	}
+
+	if(num_raster_workers > 0){ //A frame is only a few cache-sized bands; split it finer so every thread gets several
+		int thread_rows = screen_bounds.y2 / ((num_raster_workers + 1) * BANDS_PER_THREAD);
+
+		if(thread_rows < band_rows){
+			band_rows = thread_rows;
+		}
+	}
+	if(band_rows < 1){
+		band_rows = 1;
+	}
+
+	int num_bands = (screen_bounds.y2 + band_rows - 1) / band_rows;
+	if(!reserve((void**) &band_start, &band_start_capacity, 2 * (num_bands + 1), sizeof(int))){
+		num_commands = 0; //Nothing sensible can be drawn without memory; drop the list rather than draw it out of order
+		command_text_used = 0;
+		command_points_used = 0;
+		return;
+	}
+	int* band_fill = band_start + num_bands + 1; //Next free slot of each band while band_entries is being filled
+
+	if(!glyph_cache_ready){
+		build_glyph_cache();
+	}
+	if(!glyph_coverage_ready){
+		build_glyph_coverage();
+	}
+
+	//Count how many commands touch each band
+	memset(band_start, 0, (num_bands + 1) * sizeof(int));
+	for(i = 0; i < num_commands; i++){
+		struct bounds area = command_bounds(&commands[i]);
+
+		if(back_buffer){
+			mark_dirty(area.x1, area.y1, area.x2 - area.x1, area.y2 - area.y1);
+		}
+		STATS_PRIMITIVE(command_primitives[commands[i].type], area.x1, area.y1, area.x2 - area.x1, area.y2 - area.y1);
+
+		if(area.y1 < screen_bounds.y1) area.y1 = screen_bounds.y1;
+		if(area.y2 > screen_bounds.y2) area.y2 = screen_bounds.y2;
+		if(area.y1 >= area.y2 || area.x2 <= screen_bounds.x1 || area.x1 >= screen_bounds.x2){ //Entirely off screen
+			continue;
+		}
+
+		for(b = area.y1 / band_rows; b <= (area.y2 - 1) / band_rows; b++){
+			band_start[b + 1]++;
+		}
+	}
+
+	//Turn the counts into starting offsets
+	for(b = 0; b < num_bands; b++){
+		band_start[b + 1] += band_start[b];
+		band_fill[b] = band_start[b];
+	}
+
+	if(!reserve((void**) &band_entries, &band_entries_capacity, band_start[num_bands], sizeof(int))){
+		num_commands = 0;
+		command_text_used = 0;
+		command_points_used = 0;
+		return;
+	}
+
+	//Bucket the commands, keeping their recorded order within each band
+	for(i = 0; i < num_commands; i++){
+		struct bounds area = command_bounds(&commands[i]);
+
+		if(area.y1 < screen_bounds.y1) area.y1 = screen_bounds.y1;
+		if(area.y2 > screen_bounds.y2) area.y2 = screen_bounds.y2;
+		if(area.y1 >= area.y2 || area.x2 <= screen_bounds.x1 || area.x1 >= screen_bounds.x2){
+			continue;
+		}
+
+		for(b = area.y1 / band_rows; b <= (area.y2 - 1) / band_rows; b++){
+			band_entries[band_fill[b]++] = i;
+		}
+	}
+
+	draw_bands(band_rows, num_bands);
+
+	num_commands = 0;
+	command_text_used = 0;
+	command_points_used = 0;
+}
+
+//Append a command to the list.  If the list cannot grow, whatever is already
+//recorded is submitted and this command is drawn immediately, which keeps
+//the drawing order intact.
+static void record(const struct draw_command* command){
+	if(reserve((void**) &commands, &commands_capacity, num_commands + 1, sizeof(struct draw_command))){
+		commands[num_commands++] = *command;
+		return;
+	}
+
+	submit();
+
+	struct bounds area = command_bounds(command);
+	if(back_buffer){
+		mark_dirty(area.x1, area.y1, area.x2 - area.x1, area.y2 - area.y1);
+	}
+	STATS_PRIMITIVE(command_primitives[command->type], area.x1, area.y1, area.x2 - area.x1, area.y2 - area.y1);
+	run_command(&screen_bounds, command);
+}
+
+//Record a draw_pixel() for the next submit()
+void record_pixel(int x, int y, color_t c){
+	struct draw_command command = {.type = COMMAND_PIXEL, .x = x, .y = y, .width = 1, .height = 1, .pixel = map_color(c)};
+	record(&command);
+}
+
+//Record a fill_rect() for the next submit()
+void record_fill_rect(int x, int y, int width, int height, color_t c){
+	struct draw_command command = {.type = COMMAND_FILL_RECT, .x = x, .y = y, .width = width, .height = height, .pixel = map_color(c)};
+	record(&command);
+}
+
+//Record a draw_rect() for the next submit()
+void record_rect(int x, int y, int width, int height, color_t c){
+	struct draw_command command = {.type = COMMAND_RECT, .x = x, .y = y, .width = width, .height = height, .pixel = map_color(c)};
+	record(&command);
+}
+
+//Record a draw_hline() for the next submit()
+void record_hline(int x, int y, int length, color_t c){
+	record_fill_rect(x, y, length, 1, c);
+}
+
+//Record a draw_vline() for the next submit()
+void record_vline(int x, int y, int length, color_t c){
+	struct draw_command command = {.type = COMMAND_VLINE, .x = x, .y = y, .width = 1, .height = length, .pixel = map_color(c)};
+	record(&command);
+}
+
+//Record a draw_text() for the next submit(); the text is copied, so the caller may reuse its buffer
+void record_text(int x, int y, const char* text, color_t c){
+	int length = strlen(text);
+
+	if(!reserve((void**) &command_text, &command_text_capacity, command_text_used + length, 1)){
+		submit(); //Out of memory for the text; keep the order by drawing everything now
+		draw_text(x, y, text, c);
+		return;
+	}
+
+	struct draw_command command = {.type = COMMAND_TEXT, .x = x, .y = y, .width = length, .height = GLYPH_HEIGHT, .data_offset = command_text_used, .pixel = map_color(c)};
+	memcpy(command_text + command_text_used, text, length);
+	command_text_used += length;
+
+	record(&command);
+}
+
+//Record a blend_rect() for the next submit()
+void record_blend_rect(int x, int y, int width, int height, color_t c, int alpha){
+	if(alpha <= 0){
+		return;
+	}
+	if(alpha >= 255){
+		record_fill_rect(x, y, width, height, c);
+		return;
+	}
+
+	struct draw_command command = {.type = COMMAND_BLEND_RECT, .x = x, .y = y, .width = width, .height = height, .pixel = map_color(c), .alpha = alpha};
+	record(&command);
+}
+
+//Record a draw_text_aa() for the next submit(); the text is copied, so the caller may reuse its buffer
+void record_text_aa(int x, int y, const char* text, color_t c, int alpha){
+	int length = strlen(text);
+
+	if(alpha <= 0){
+		return;
+	}
+	if(!reserve((void**) &command_text, &command_text_capacity, command_text_used + length, 1)){
+		submit(); //Out of memory for the text; keep the order by drawing everything now
+		draw_text_aa(x, y, text, c, alpha);
+		return;
+	}
+
+	struct draw_command command = {.type = COMMAND_TEXT_AA, .x = x, .y = y, .width = length, .height = GLYPH_HEIGHT, .data_offset = command_text_used, .pixel = map_color(c), .alpha = alpha > 255 ? 255 : alpha};
+	memcpy(command_text + command_text_used, text, length);
+	command_text_used += length;
+
+	record(&command);
+}
+
+//Record a draw_line() for the next submit()
+void record_line(int x0, int y0, int x1, int y1, color_t c){
+	struct draw_command command = {.type = COMMAND_LINE, .x = x0, .y = y0, .width = x1, .height = y1, .pixel = map_color(c)};
+	record(&command);
+}
+
+//Record a draw_circle() for the next submit()
+void record_circle(int cx, int cy, int r, color_t c){
+	struct draw_command command = {.type = COMMAND_CIRCLE, .x = cx, .y = cy, .width = r, .pixel = map_color(c)};
+	record(&command);
+}
+
+//Record a fill_circle() for the next submit()
+void record_fill_circle(int cx, int cy, int r, color_t c){
+	struct draw_command command = {.type = COMMAND_FILL_CIRCLE, .x = cx, .y = cy, .width = r, .pixel = map_color(c)};
+	record(&command);
+}
+
+//Record a fill_polygon() for the next submit(); the points are copied, so the caller may reuse its array
+void record_polygon(const int* points, int num_points, color_t c){
+	if(!reserve((void**) &command_points, &command_points_capacity, command_points_used + 2*num_points, sizeof(int))){
+		submit(); //Out of memory for the points; keep the order by drawing everything now
+		fill_polygon(points, num_points, c);
+		return;
+	}
+
+	struct draw_command command = {.type = COMMAND_POLYGON, .width = num_points, .data_offset = command_points_used, .pixel = map_color(c)};
+	memcpy(command_points + command_points_used, points, 2*num_points*sizeof(int));
+	command_points_used += 2*num_points;
+
+	record(&command);
+}
+
+// Tiled rendering ---------------------------------------------------------
+//
+//With more than one raster thread, submit() hands its bands to a small pool
+//of worker threads, and the calling thread works alongside them.  Threads
+//claim whole bands with an atomic counter; bands never overlap, so each one
+//is written by exactly one thread and the draw buffer needs no locks.
+
+pthread_t* raster_workers; //The pool; the calling thread makes one more
+int num_raster_workers;
+pthread_mutex_t raster_lock = PTHREAD_MUTEX_INITIALIZER; //Protects the fields below
+pthread_cond_t raster_start = PTHREAD_COND_INITIALIZER; //Signaled when a new frame's bands are ready, or the pool is stopping
+pthread_cond_t raster_done = PTHREAD_COND_INITIALIZER; //Signaled when the last worker finishes a frame
+unsigned long raster_generation; //Bumped once per frame handed to the pool
+int raster_busy_workers; //Workers still drawing the current frame
+int raster_stopping;
+int job_band_rows; //The frame being drawn
+int job_num_bands;
+int job_next_band; //Next band nobody has claimed yet; taken with an atomic add
+
+//Claim and draw bands of the current frame until none are left
+static void draw_claimed_bands(){
+	int b = 0;
+
+	while((b = __sync_fetch_and_add(&job_next_band, 1)) < job_num_bands){
+		draw_band(b, job_band_rows);
+	}
+}
+
+static void* raster_worker(void* unused){
+	unsigned long seen_generation = 0;
+	(void) unused; //pthread_create() passes NULL
+
+	pthread_mutex_lock(&raster_lock);
+	for(;;){
+		while(raster_generation == seen_generation && !raster_stopping){
+			pthread_cond_wait(&raster_start, &raster_lock);
+		}
+
+		if(raster_stopping){
+			break;
+		}
+
+		seen_generation = raster_generation;
+		pthread_mutex_unlock(&raster_lock);
+
+		draw_claimed_bands();
+
+		pthread_mutex_lock(&raster_lock);
+		if(--raster_busy_workers == 0){
+			pthread_cond_signal(&raster_done);
+		}
+	}
+	pthread_mutex_unlock(&raster_lock);
+
+	return NULL;
+}
+
+//Draw the bands of the current command list, splitting them across the pool if there is one
+static void draw_bands(int band_rows, int num_bands){
+	int b = 0;
+
+	if(num_raster_workers == 0 || num_bands < 2){
+		for(b = 0; b < num_bands; b++){
+			draw_band(b, band_rows);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&raster_lock);
+	job_band_rows = band_rows;
+	job_num_bands = num_bands;
+	job_next_band = 0;
+	raster_busy_workers = num_raster_workers;
+	raster_generation++;
+	pthread_cond_broadcast(&raster_start);
+	pthread_mutex_unlock(&raster_lock);
+
+	draw_claimed_bands(); //Help out instead of sitting idle
+
+	pthread_mutex_lock(&raster_lock);
+	while(raster_busy_workers > 0){ //The command list must not change until every worker is done reading it
+		pthread_cond_wait(&raster_done, &raster_lock);
+	}
+	pthread_mutex_unlock(&raster_lock);
+}
+
+//Use count threads (including the caller) to draw submitted command lists; 1 turns tiled rendering off
+//Returns the number of threads actually in use
+int set_raster_threads(int count){
+	int i = 0;
+
+	//Stop the current pool, if any
+	if(num_raster_workers > 0){
+		pthread_mutex_lock(&raster_lock);
+		raster_stopping = 1;
+		pthread_cond_broadcast(&raster_start);
+		pthread_mutex_unlock(&raster_lock);
+
+		for(i = 0; i < num_raster_workers; i++){
+			pthread_join(raster_workers[i], NULL);
+		}
+
+		free(raster_workers);
+		raster_workers = NULL;
+		num_raster_workers = 0;
+		raster_stopping = 0;
+		raster_generation = 0;
+	}
+
+	if(count <= 1){
+		return 1;
+	}
+
+	raster_workers = (pthread_t*) malloc((count - 1) * sizeof(pthread_t));
+	if(!raster_workers){
+		return 1;
+	}
+
+	for(i = 0; i < count - 1; i++){
+		if(pthread_create(&raster_workers[i], NULL, raster_worker, NULL) != 0){
+			break; //Run with however many threads could be started
+		}
+		num_raster_workers++;
+	}
+
+	return num_raster_workers + 1;
+}
+
+// Retained objects ----------------------------------------------------------
+//
+//Instead of erasing and redrawing every frame, an animation can hand the
+//library objects that stay on screen until they are changed.  Changing an
+//object (moving it, recoloring it, hiding it) adds its old and new bounding
+//boxes to a damage list, merged where they touch, so a small move becomes
+//one rectangle covering both positions.  update_scene() repaints only the
+//damaged rectangles: background first, then every visible object that
+//touches them in order of id (lower ids underneath), each clipped to the
+//rectangle.
+//When nothing has changed it does no drawing at all.  Objects own the parts
+//of the screen they repaint; anything drawn there directly is painted over.
+
+struct scene_object{
+	int in_use; //Cleared when the object is removed; its slot is reused
+	int visible;
+	struct draw_command command; //What the object draws and where; text objects take their characters from text
+	char* text; //Copy of a text object's string
+	const struct sprite* sprite; //Set for sprite objects, which do not use command
+};
+
+struct scene_object* scene_objects;
+int num_scene_objects; //Slots in use or freed; the array is never compacted, so object ids stay valid
+int scene_objects_capacity;
+uint32_t scene_background; //Native pixel damaged areas are cleared to before the objects are drawn
+struct bounds scene_damage[MAX_DIRTY_RECTS]; //Regions update_scene() must repaint
+int num_scene_damage;
+
+//The region an object covers
+static struct bounds object_bounds(const struct scene_object* object){
+	if(object->sprite){
+		struct bounds area = {object->command.x, object->command.y, object->command.x + object->sprite->width, object->command.y + object->sprite->height};
+		return area;
+	}
+
+	return command_bounds(&object->command);
+}
+
+//Add an object's current bounding box to the damage, if it is showing
+static void damage_object(const struct scene_object* object){
+	if(object->visible){
+		struct bounds area = object_bounds(object);
+		add_rect(scene_damage, &num_scene_damage, area.x1, area.y1, area.x2 - area.x1, area.y2 - area.y1);
+	}
+}
+
+//Draw the part of an object that lies inside clip
+static void draw_object(const struct bounds* clip, const struct scene_object* object){
+	const struct draw_command* command = &object->command;
+
+	if(object->sprite){
+		raster_sprite(clip, command->x, command->y, object->sprite);
+	} else if(command->type == COMMAND_TEXT){
+		raster_glyphs(clip, command->x, command->y, (const unsigned char*) object->text, command->width, command->pixel);
+	} else if(command->type == COMMAND_TEXT_AA){
+		raster_glyphs_aa(clip, command->x, command->y, (const unsigned char*) object->text, command->width, command->pixel, command->alpha);
+	} else{
+		run_command(clip, command);
+	}
+}
+
+//Look up a live object by id; NULL if there is none
+static struct scene_object* find_object(int id){
+	if(id < 0 || id >= num_scene_objects || !scene_objects[id].in_use){
+		return NULL;
+	}
+
+	return &scene_objects[id];
+}
+
+//Add a visible object drawing command (or sprite) to the scene; returns its id, or -1 if it could not be stored
+static int add_object(const struct draw_command* command, const char* text, const struct sprite* sprite){
+	int id = 0;
+
+	for(id = 0; id < num_scene_objects && scene_objects[id].in_use; id++){} //Reuse the first free slot
+
+	if(id == num_scene_objects){
+		if(!reserve((void**) &scene_objects, &scene_objects_capacity, num_scene_objects + 1, sizeof(struct scene_object))){
+			return -1;
+		}
+		num_scene_objects++;
+	}
+
+	struct scene_object* object = &scene_objects[id];
+	object->in_use = 1;
+	object->visible = 1;
+	object->command = *command;
+	object->text = NULL;
+	object->sprite = sprite;
+
+	if(text){
+		object->text = strdup(text);
+		if(!object->text){
+			object->in_use = 0;
+			return -1;
+		}
+		if(!glyph_cache_ready){
+			build_glyph_cache();
+		}
+		if(!glyph_coverage_ready){
+			build_glyph_coverage();
+		}
+	}
+
+	damage_object(object);
+
+	return id;
+}
+
+//Add a rectangle outline covering (x, y) through (x + width, y + height), like draw_rect(); returns the object's id, or -1
+int add_rect_object(int x, int y, int width, int height, color_t c){
+	struct draw_command command = {.type = COMMAND_RECT, .x = x, .y = y, .width = width, .height = height, .pixel = map_color(c)};
+	return add_object(&command, NULL, NULL);
+}
+
+//Add a solid rectangle, like fill_rect(); returns the object's id, or -1
+int add_fill_rect_object(int x, int y, int width, int height, color_t c){
+	struct draw_command command = {.type = COMMAND_FILL_RECT, .x = x, .y = y, .width = width, .height = height, .pixel = map_color(c)};
+	return add_object(&command, NULL, NULL);
+}
+
+//Add a translucent rectangle, like blend_rect(); returns the object's id, or -1
+int add_blend_rect_object(int x, int y, int width, int height, color_t c, int alpha){
+	struct draw_command command = {.type = COMMAND_BLEND_RECT, .x = x, .y = y, .width = width, .height = height, .pixel = map_color(c), .alpha = alpha < 0 ? 0 : alpha > 255 ? 255 : alpha};
+	return add_object(&command, NULL, NULL);
+}
+
+//Add a line, like draw_line(); returns the object's id, or -1
+int add_line_object(int x0, int y0, int x1, int y1, color_t c){
+	struct draw_command command = {.type = COMMAND_LINE, .x = x0, .y = y0, .width = x1, .height = y1, .pixel = map_color(c)};
+	return add_object(&command, NULL, NULL);
+}
+
+//Add a circle outline, like draw_circle(), or a filled circle if filled is set; returns the object's id, or -1
+int add_circle_object(int cx, int cy, int r, int filled, color_t c){
+	struct draw_command command = {.type = filled ? COMMAND_FILL_CIRCLE : COMMAND_CIRCLE, .x = cx, .y = cy, .width = r, .pixel = map_color(c)};
+	return add_object(&command, NULL, NULL);
+}
+
+//Add a line of text, like draw_text(); returns the object's id, or -1
+int add_text_object(int x, int y, const char* text, color_t c){
+	struct draw_command command = {.type = COMMAND_TEXT, .x = x, .y = y, .width = strlen(text), .height = GLYPH_HEIGHT, .pixel = map_color(c)};
+	return add_object(&command, text, NULL);
+}
+
+//Add a sprite, like draw_sprite(); the sprite is not copied and must outlive the object. Returns the object's id, or -1
+int add_sprite_object(int x, int y, const struct sprite* sprite){
+	struct draw_command command = {.type = COMMAND_FILL_RECT, .x = x, .y = y}; //Only the position is used
+	return sprite ? add_object(&command, NULL, sprite) : -1;
+}
+
+//Move an object so its anchor (the top-left corner, a circle's center or a line's first end) is at (x, y)
+void move_object(int id, int x, int y){
+	struct scene_object* object = find_object(id);
+
+	if(!object || (object->command.x == x && object->command.y == y)){
+		return;
+	}
+
+	damage_object(object); //Where it was
+	if(object->command.type == COMMAND_LINE){ //The far end moves along with it
+		object->command.width += x - object->command.x;
+		object->command.height += y - object->command.y;
+	}
+	object->command.x = x;
+	object->command.y = y;
+	damage_object(object); //Where it is now
+}
+
+//Change the color of an object; sprites keep their own colors
+void set_object_color(int id, color_t c){
+	struct scene_object* object = find_object(id);
+	uint32_t pixel = map_color(c);
+
+	if(object && !object->sprite && object->command.pixel != pixel){
+		object->command.pixel = pixel;
+		damage_object(object);
+	}
+}
+
+//Change the string a text object shows
+void set_object_text(int id, const char* text){
+	struct scene_object* object = find_object(id);
+
+	if(!object || !object->text || strcmp(object->text, text) == 0){
+		return;
+	}
+
+	char* copy = strdup(text);
+	if(!copy){
+		return;
+	}
+
+	damage_object(object); //The old string may be longer than the new one
+	free(object->text);
+	object->text = copy;
+	object->command.width = strlen(copy);
+	damage_object(object);
+}
+
+//Show or hide an object
+void show_object(int id, int visible){
+	struct scene_object* object = find_object(id);
+
+	if(!object || object->visible == !!visible){
+		return;
+	}
+
+	object->visible = 1; //Damage covers it whether it is appearing or disappearing
+	damage_object(object);
+	object->visible = !!visible;
+}
+
+//Remove an object from the scene; its id may be handed out again
+void remove_object(int id){
+	struct scene_object* object = find_object(id);
+
+	if(!object){
+		return;
+	}
+
+	damage_object(object);
+	free(object->text);
+	object->text = NULL;
+	object->in_use = 0;
+}
+
+//Set the color behind the objects and repaint the whole screen with it on the next update_scene()
+void set_scene_background(color_t c){
+	scene_background = map_color(c);
+	add_rect(scene_damage, &num_scene_damage, screen_bounds.x1, screen_bounds.y1, screen_bounds.x2 - screen_bounds.x1, screen_bounds.y2 - screen_bounds.y1);
+}
+
+//Repaint whatever the objects' changes since the last call damaged; returns the number of rectangles repainted.
+//With double buffering, present() afterwards copies just those rectangles to the display.
+int update_scene(){
+	int damaged = num_scene_damage;
+	int i = 0;
+	int j = 0;
+
+	submit(); //Anything recorded lands first, so the repaint goes on top of it
+
+	for(i = 0; i < num_scene_damage; i++){
+		struct bounds* rect = &scene_damage[i];
+
+		if(back_buffer){
+			mark_dirty(rect->x1, rect->y1, rect->x2 - rect->x1, rect->y2 - rect->y1);
+		}
+
+		raster_fill_rect(rect, rect->x1, rect->y1, rect->x2 - rect->x1, rect->y2 - rect->y1, scene_background);
+		for(j = 0; j < num_scene_objects; j++){
+			struct scene_object* object = &scene_objects[j];
+
+			if(!object->in_use || !object->visible){
+				continue;
+			}
+
+			struct bounds area = object_bounds(object);
+			if(area.x1 < rect->x2 && rect->x1 < area.x2 && area.y1 < rect->y2 && rect->y1 < area.y2){
+				draw_object(rect, object);
+			}
+		}
+	}
+
+	num_scene_damage = 0;
+
+	return damaged;
 }
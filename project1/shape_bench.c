@@ -0,0 +1,123 @@
+#include "bench_util.h"
+
+//Shape benchmark: draws a fixed set of random lines, circle outlines,
+//filled circles and polygons over and over into the back buffer, and
+//reports shapes and pixels per second for each kind. The pixels of each
+//shape are counted once up front by drawing it alone and counting what
+//changed, so the rate is what actually reached memory.
+//Usage: ./shape_bench [repetitions]
+
+#define NUM_SHAPES 256
+#define POLYGON_POINTS 6
+
+enum shape_kind {
+	SHAPE_LINE,
+	SHAPE_CIRCLE,
+	SHAPE_FILL_CIRCLE,
+	SHAPE_POLYGON,
+	NUM_SHAPE_KINDS
+};
+
+const char* shape_names[NUM_SHAPE_KINDS] = {"lines", "circles", "filled circles", "polygons"};
+
+int shape_points[NUM_SHAPES][2*POLYGON_POINTS]; //Lines use the first two points, circles the first as their center
+int shape_radius[NUM_SHAPES];
+
+//Draw shape i of the given kind
+void draw_shape(int kind, int i, color_t c){
+	int* p = shape_points[i];
+
+	switch(kind){
+		case SHAPE_LINE:
+			draw_line(p[0], p[1], p[2], p[3], c);
+			break;
+		case SHAPE_CIRCLE:
+			draw_circle(p[0], p[1], shape_radius[i], c);
+			break;
+		case SHAPE_FILL_CIRCLE:
+			fill_circle(p[0], p[1], shape_radius[i], c);
+			break;
+		case SHAPE_POLYGON:
+			fill_polygon(p, POLYGON_POINTS, c);
+			break;
+	}
+}
+
+//Pixels the shapes of one kind write, counted by drawing each on its own into a cleared back buffer
+long count_pixels(int kind){
+	long pixels = 0;
+	int i = 0;
+	int x = 0;
+	int y = 0;
+
+	for(i = 0; i < NUM_SHAPES; i++){
+		memset(back_buffer, 0, screen_bounds.y2 * stride);
+		draw_shape(kind, i, MAKE_COLOR(31, 63, 31));
+
+		for(y = 0; y < screen_bounds.y2; y++){
+			for(x = 0; x < screen_bounds.x2; x++){
+				unsigned char* pixel = pixel_address(back_buffer, x, y);
+				int byte = 0;
+
+				for(byte = 0; byte < backend.bytes_per_pixel; byte++){
+					if(pixel[byte]){
+						pixels++;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	return pixels;
+}
+
+int main(int argc, char** argv){
+	long pixels[NUM_SHAPE_KINDS];
+	double seconds[NUM_SHAPE_KINDS];
+	int repetitions = 0;
+	struct timespec start;
+	int kind = 0;
+	int rep = 0;
+	int i = 0;
+	int j = 0;
+
+	repetitions = bench_setup(argc, argv, 200);
+	enable_double_buffer(); //Draw off screen so the counts are not disturbed and the display is left alone
+
+	int width = screen_var_info.xres;
+	int height = screen_var_info.yres;
+	int radius = (width < height ? width : height) / 4;
+
+	srand(1550);
+	for(i = 0; i < NUM_SHAPES; i++){ //Some shapes poke off the screen so clipping is exercised too
+		for(j = 0; j < POLYGON_POINTS; j++){
+			shape_points[i][2*j] = rand() % (width + width/4) - width/8;
+			shape_points[i][2*j + 1] = rand() % (height + height/4) - height/8;
+		}
+		shape_radius[i] = 1 + i * radius / NUM_SHAPES;
+	}
+
+	for(kind = 0; kind < NUM_SHAPE_KINDS; kind++){
+		pixels[kind] = count_pixels(kind) * repetitions;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(rep = 0; rep < repetitions; rep++){
+			for(i = 0; i < NUM_SHAPES; i++){
+				draw_shape(kind, i, MAKE_COLOR(rep % 32, i % 64, kind * 8));
+			}
+		}
+		seconds[kind] = seconds_since(&start);
+	}
+
+	present();
+	exit_graphics();
+
+	printf("%dx%d, %d bpp, %d shapes x %d repetitions\n", width, height, screen_var_info.bits_per_pixel, NUM_SHAPES, repetitions);
+	for(kind = 0; kind < NUM_SHAPE_KINDS; kind++){
+		printf("%-15s %10.0f shapes/s %8.1f Mpixels/s\n", shape_names[kind],
+			NUM_SHAPES * repetitions / seconds[kind], pixels[kind] / seconds[kind] / 1e6);
+	}
+
+	return 0;
+}
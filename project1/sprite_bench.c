@@ -0,0 +1,90 @@
+#include "bench_util.h"
+
+//Sprite benchmark: covers the screen with a grid of 32x32 icons (a ring on
+//a transparent background) and reports icons per second drawn opaque,
+//drawn through the run-length encoded color key, and drawn the naive way,
+//testing every pixel against the key and calling draw_pixel.
+//Usage: ./sprite_bench [screens per test]
+
+#define ICON_SIZE 32
+#define ICON_KEY MAKE_COLOR(31, 0, 31) //Magenta marks transparent pixels
+
+color_t icon[ICON_SIZE * ICON_SIZE];
+
+//The naive color-key blit: one test and one draw_pixel per pixel
+void draw_icon_per_pixel(int x, int y){
+	int i = 0;
+	int j = 0;
+
+	for(i = 0; i < ICON_SIZE; i++){
+		for(j = 0; j < ICON_SIZE; j++){
+			if(icon[i*ICON_SIZE + j] != ICON_KEY){
+				draw_pixel(x + j, y + i, icon[i*ICON_SIZE + j]);
+			}
+		}
+	}
+}
+
+int main(int argc, char** argv){
+	const char* names[3] = {"opaque", "color key (runs)", "color key (per pixel)"};
+	double seconds[3];
+	int screens = 0;
+	struct timespec start;
+	int test = 0;
+	int n = 0;
+	int x = 0;
+	int y = 0;
+
+	for(y = 0; y < ICON_SIZE; y++){ //A ring, transparent inside and out
+		for(x = 0; x < ICON_SIZE; x++){
+			int dx = 2*x - ICON_SIZE + 1;
+			int dy = 2*y - ICON_SIZE + 1;
+			int distance = dx*dx + dy*dy;
+
+			icon[y*ICON_SIZE + x] = distance < 30*30 && distance > 18*18 ? MAKE_COLOR(x, 2*y, 31 - x) : ICON_KEY;
+		}
+	}
+
+	screens = bench_setup(argc, argv, 50);
+
+	int width = screen_var_info.xres;
+	int height = screen_var_info.yres;
+	int icons_per_screen = (width / ICON_SIZE) * (height / ICON_SIZE);
+	struct sprite* opaque = create_sprite(ICON_SIZE, ICON_SIZE, icon);
+	struct sprite* keyed = create_sprite(ICON_SIZE, ICON_SIZE, icon);
+
+	if(!opaque || !keyed || !set_sprite_key(keyed, ICON_KEY)){
+		exit_graphics();
+		printf("could not create the icon\n");
+		return 1;
+	}
+
+	for(test = 0; test < 3; test++){
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(n = 0; n < screens; n++){
+			for(y = 0; y + ICON_SIZE <= height; y += ICON_SIZE){
+				for(x = 0; x + ICON_SIZE <= width; x += ICON_SIZE){
+					if(test == 0){
+						draw_sprite(x, y, opaque);
+					} else if(test == 1){
+						draw_sprite(x, y, keyed);
+					} else{
+						draw_icon_per_pixel(x, y);
+					}
+				}
+			}
+		}
+		seconds[test] = seconds_since(&start);
+	}
+
+	free_sprite(opaque);
+	free_sprite(keyed);
+	exit_graphics();
+
+	printf("%dx%d, %d bpp, %d icons per screen, %d screens per test\n", width, height, screen_var_info.bits_per_pixel, icons_per_screen, screens);
+	for(test = 0; test < 3; test++){
+		printf("%-22s %10.0f icons/s\n", names[test], (double) icons_per_screen * screens / seconds[test]);
+	}
+
+	return 0;
+}
@@ -8,36 +8,53 @@ void init_graphics();
 char getkey();
 void sleep_ms(long ms);
 
-void draw_rect(int x1, int y1, int width, int height, color_t c);
+int add_rect_object(int x, int y, int width, int height, color_t c);
+void move_object(int id, int x, int y);
+int update_scene();
+int enable_double_buffer();
+void present();
+void frame_begin();
+char frame_end_key(int target_hz);
+const struct frame_stats* get_frame_stats();
+
+#define FRAME_RATE 50 //One frame every 20 ms
 
 int main(int argc, char** argv)
 {
 	int i;
 
 	init_graphics();
+	enable_double_buffer(); //Only the damaged area is copied to the display each frame
 
 	char key;
 	int x = (640-20)/2;
 	int y = (480-20)/2;
+	int square = add_rect_object(x, y, 20, 20, 15); //The library keeps the blue rectangle on screen and erases it when it moves
+	key = '\0';
 
 	do
 	{
-		//draw a black rectangle to erase the old one
-		draw_rect(x, y, 20, 20, 0);
+		frame_begin();
 
-		key = getkey();
 		if(key == 'w') y-=10;
 		else if(key == 's') y+=10;
 		else if(key == 'a') x-=10;
 		else if(key == 'd') x+=10;
 
-		//draw a blue rectangle
-		draw_rect(x, y, 20, 20, 15);
-		sleep_ms(20);
+		move_object(square, x, y); //Damages the old and new positions; nothing at all if it did not move
+		update_scene();
+		present();
+
+		key = frame_end_key(FRAME_RATE); //Wait out the rest of the frame, but move as soon as a key is pressed
 	} while(key != 'q');
 
 	exit_graphics();
 
+	const struct frame_stats* stats = get_frame_stats();
+	if(stats->frames > 0){
+		printf("%lu frames, %lu missed deadlines, %lld us average and %lld us worst drawing time\n", stats->frames, stats->missed_deadlines, stats->total_render_ns / 1000 / (long long) stats->frames, stats->worst_render_ns / 1000);
+	}
+
 	return 0;
 
 }
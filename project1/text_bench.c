@@ -0,0 +1,62 @@
+#include "bench_util.h"
+
+//Text benchmark: draws the same lines of text with the original per-pixel
+//draw_char loop and with draw_text, then reports glyphs per second for each.
+//Usage: ./text_bench [number of lines]
+
+#define LINE_LENGTH 80
+
+//The original draw_char: tests every bit of the glyph and calls draw_pixel for each set one
+void draw_char_per_pixel(int x, int y, const char character, color_t c){
+	int i = 0;
+	int j = 0;
+
+	for(i = 0; i < 16; i++){ //Iterate through the rows
+		int curr_row = iso_font[(unsigned char) character*16 + i]; //Get the pixel data for row i
+
+		for(j = 0; j < 8; j++){ //Iterate left through right in this specific row
+			if(curr_row & 0x01){
+				draw_pixel(x + j, y + i, c);
+			}
+			curr_row >>= 1;
+		}
+	}
+}
+
+int main(int argc, char** argv){
+	long lines = 0;
+	char line[LINE_LENGTH + 1];
+	struct timespec start;
+	long i = 0;
+	int j = 0;
+
+	for(j = 0; j < LINE_LENGTH; j++){ //A line of every printable ASCII character
+		line[j] = ' ' + (j % 95);
+	}
+	line[LINE_LENGTH] = '\0';
+
+	lines = bench_setup(argc, argv, 20000);
+	int rows = screen_var_info.yres / 16; //Scroll through the visible screen like a log tail would
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < lines; i++){
+		for(j = 0; j < LINE_LENGTH; j++){
+			draw_char_per_pixel(j*8, (i % rows) * 16, line[j], MAKE_COLOR(31, 63, 31));
+		}
+	}
+	double per_pixel_time = seconds_since(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < lines; i++){
+		draw_text(0, (i % rows) * 16, line, MAKE_COLOR(0, 63, 0));
+	}
+	double glyph_run_time = seconds_since(&start);
+
+	exit_graphics();
+
+	double glyphs = (double) lines * LINE_LENGTH;
+	printf("per-pixel draw_char: %12.0f glyphs/s\n", glyphs / per_pixel_time);
+	printf("glyph-run draw_text: %12.0f glyphs/s (%.1fx)\n", glyphs / glyph_run_time, per_pixel_time / glyph_run_time);
+
+	return 0;
+}
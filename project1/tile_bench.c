@@ -0,0 +1,64 @@
+#include "bench_util.h"
+
+//Tiled rendering benchmark: repaints the whole screen every frame (a
+//background, a grid of panels with outlines and a screen full of text)
+//through a command list, and reports frames per second with 1, 2, 4 and 8
+//raster threads.
+//Usage: ./tile_bench [frames per thread count]
+
+#define PANEL_SIZE 64
+
+//Record one full repaint of the screen
+void record_frame(int frame){
+	char line[256];
+	int width = screen_var_info.xres;
+	int height = screen_var_info.yres;
+	int x = 0;
+	int y = 0;
+
+	record_fill_rect(0, 0, width, height, MAKE_COLOR(0, 0, 4));
+
+	for(y = 0; y + PANEL_SIZE <= height; y += PANEL_SIZE){ //Dashboard-style panels
+		for(x = 0; x + PANEL_SIZE <= width; x += PANEL_SIZE){
+			record_fill_rect(x + 2, y + 2, PANEL_SIZE - 4, PANEL_SIZE - 4, MAKE_COLOR((x / PANEL_SIZE + frame) % 32, 20, 8));
+			record_rect(x + 2, y + 2, PANEL_SIZE - 5, PANEL_SIZE - 5, MAKE_COLOR(31, 63, 31));
+		}
+	}
+
+	for(y = 0; y + 16 <= height; y += 16){ //A log view over the top of it
+		snprintf(line, sizeof(line), "frame %6d row %4d  the quick brown fox jumps over the lazy dog 0123456789", frame, y / 16);
+		record_text(0, y, line, MAKE_COLOR(0, 63, 0));
+	}
+}
+
+int main(int argc, char** argv){
+	int thread_counts[] = {1, 2, 4, 8};
+	double fps[4];
+	int threads_used[4];
+	int frames = 0;
+	struct timespec start;
+	int i = 0;
+	int frame = 0;
+
+	frames = bench_setup(argc, argv, 200);
+
+	for(i = 0; i < 4; i++){
+		threads_used[i] = set_raster_threads(thread_counts[i]);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(frame = 0; frame < frames; frame++){
+			record_frame(frame);
+			submit();
+		}
+		fps[i] = frames / seconds_since(&start);
+	}
+
+	exit_graphics();
+
+	printf("%dx%d, %d bpp, %d frames per run\n", screen_var_info.xres, screen_var_info.yres, screen_var_info.bits_per_pixel, frames);
+	for(i = 0; i < 4; i++){
+		printf("%d thread(s): %8.1f fps\n", threads_used[i], fps[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Build prodcons and time the buffer guarded by the userspace semaphores,
+# by the kernel's semaphore syscalls with and without adaptive spinning and
+# in blocks of 8 through cs1550_down_n()/cs1550_up_n(), and the lock-free
+# ring, with 2, 4, 8 and 16 producers and as many consumers.  Needs a
+# kernel with the cs1550 syscalls; the run without spinning also needs
+# write access to /proc/cs1550_spin (run as root).
+# Usage: ./bench.sh [items per producer] [buffer size]    (default 200000 256)
+
+set -e
+cd "$(dirname "$0")"
+
+items=${1:-200000}
+size=${2:-256}
+out=_bench
+spin=/proc/cs1550_spin
+
+mkdir -p $out
+gcc -O2 ${CFLAGS:-} -o $out/prodcons prodcons.c
+
+budget=$(cat $spin 2>/dev/null || echo 0)
+
+for n in 2 4 8 16; do
+	echo "== $n producers, $n consumers"
+	./$out/prodcons -q -n $items $n $n $size
+	if [ -w $spin ]; then
+		echo 0 > $spin
+		printf 'no spinning:   '
+		./$out/prodcons -q -k -n $items $n $n $size
+		echo $budget > $spin
+	fi
+	printf 'spin %6s ns: ' "$budget"
+	./$out/prodcons -q -k -n $items $n $n $size
+	./$out/prodcons -q -k -b 8 -n $((items / 8 * 8)) $n $n $size
+	./$out/prodcons -q -r -n $items $n $n $size
+done
@@ -0,0 +1,153 @@
+/*
+ * CS1550 Project 2
+ *
+ * A bounded multi-producer, multi-consumer queue of ints for processes that
+ * share memory, with no lock.  It is Dmitry Vyukov's bounded MPMC queue:
+ * every slot carries a sequence number that says whose turn it is, so a
+ * producer claims a slot with one compare-and-swap on the head and a
+ * consumer claims one with one compare-and-swap on the tail, and producers
+ * and consumers only touch each other's cache lines through the slots.
+ *
+ * Processes only enter the kernel when the ring is full or empty.  Each
+ * side then sleeps on an event count with cs1550_wait(), and the other side
+ * bumps the count and calls cs1550_wake() only if someone registered to
+ * sleep since the last wake, so a burst of items wakes sleepers once.
+ *
+ * Include cs1550_sem.c first; it defines the syscall numbers.
+ */
+
+#include <limits.h>
+#include <sys/mman.h>
+
+#define CACHE_LINE 64 //Head, tail and the event counts each get their own line so they don't false-share
+
+struct ring_slot{
+	unsigned int sequence; //Equal to the position when a producer may fill it, position + 1 when a consumer may empty it
+	int item;
+};
+
+//Sleeping side of the ring: sleepers wait for sequence to move past the value they saw
+struct ring_event{
+	unsigned int sequence;
+	int waiters; //Processes that registered to sleep since the last ring_signal() reset it; never decremented by them
+};
+
+struct cs1550_ring{
+	unsigned int head __attribute__((aligned(CACHE_LINE))); //Next position to fill
+	unsigned int tail __attribute__((aligned(CACHE_LINE))); //Next position to empty
+	struct ring_event not_empty __attribute__((aligned(CACHE_LINE))); //Consumers sleep here
+	struct ring_event not_full __attribute__((aligned(CACHE_LINE))); //Producers sleep here
+	unsigned int mask __attribute__((aligned(CACHE_LINE))); //Slots - 1; the number of slots is a power of two
+	struct ring_slot slots[];
+};
+
+//Create a ring in shared memory with at least size slots (rounded up to a power of two)
+struct cs1550_ring* cs1550_ring_create(int size){
+	unsigned int slots = 1;
+	unsigned int i;
+
+	while(slots < (unsigned int) size){
+		slots <<= 1;
+	}
+
+	struct cs1550_ring* ring = (struct cs1550_ring*) mmap(NULL, sizeof(struct cs1550_ring) + slots*sizeof(struct ring_slot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, 0, 0);
+	if(ring == MAP_FAILED){
+		return NULL;
+	}
+
+	ring->mask = slots - 1;
+	for(i = 0; i < slots; i++){
+		ring->slots[i].sequence = i;
+	}
+
+	return ring;
+}
+
+//Try to add an item; returns 0 when the ring is full
+int ring_try_push(struct cs1550_ring* ring, int item){
+	for(;;){
+		unsigned int position = *(volatile unsigned int*) &ring->head;
+		struct ring_slot* slot = &ring->slots[position & ring->mask];
+		int turn = (int) (*(volatile unsigned int*) &slot->sequence - position);
+
+		if(turn == 0){ //Our turn to fill this slot, if no other producer takes the position first
+			if(__sync_bool_compare_and_swap(&ring->head, position, position + 1)){
+				slot->item = item;
+				__sync_synchronize(); //The item must be visible before the sequence says it is there
+				slot->sequence = position + 1;
+				return 1;
+			}
+		} else if(turn < 0){ //The consumer a lap behind has not emptied it yet
+			return 0;
+		}
+		//turn > 0: another producer got here first; try the next position
+	}
+}
+
+//Try to remove an item into *item; returns 0 when the ring is empty
+int ring_try_pop(struct cs1550_ring* ring, int* item){
+	for(;;){
+		unsigned int position = *(volatile unsigned int*) &ring->tail;
+		struct ring_slot* slot = &ring->slots[position & ring->mask];
+		int turn = (int) (*(volatile unsigned int*) &slot->sequence - (position + 1));
+
+		if(turn == 0){
+			if(__sync_bool_compare_and_swap(&ring->tail, position, position + 1)){
+				*item = slot->item;
+				__sync_synchronize(); //Read the item before handing the slot to the producer a lap ahead
+				slot->sequence = position + ring->mask + 1;
+				return 1;
+			}
+		} else if(turn < 0){ //Nothing produced here yet
+			return 0;
+		}
+	}
+}
+
+//Tell sleepers on event that the ring changed. Whoever takes the count of
+//registered sleepers wakes them all, and they each look at the ring again;
+//until one of them registers again the next signals stay in user space.
+void ring_signal(struct ring_event* event){
+	__sync_synchronize(); //The slot's new sequence must be visible before we look for sleepers
+
+	if(*(volatile int*) &event->waiters > 0 && __sync_lock_test_and_set(&event->waiters, 0) > 0){
+		__sync_fetch_and_add(&event->sequence, 1);
+		syscall(__NR_cs1550_wake, &event->sequence, INT_MAX);
+	}
+}
+
+void ring_push(struct cs1550_ring* ring, int item){
+	while(!ring_try_push(ring, item)){
+		//Announce ourselves, then look once more before sleeping: a consumer
+		//that emptied a slot before seeing us is caught by the retry, and
+		//one that empties it after sees us and bumps the sequence, which
+		//makes cs1550_wait() return at once. If the retry succeeds our
+		//registration stays behind and costs one spare wake later.
+		unsigned int sequence = *(volatile unsigned int*) &ring->not_full.sequence;
+
+		__sync_fetch_and_add(&ring->not_full.waiters, 1);
+		if(ring_try_push(ring, item)){
+			break;
+		}
+		syscall(__NR_cs1550_wait, &ring->not_full.sequence, sequence, NULL);
+	}
+
+	ring_signal(&ring->not_empty);
+}
+
+int ring_pop(struct cs1550_ring* ring){
+	int item;
+
+	while(!ring_try_pop(ring, &item)){ //Same handshake as ring_push()
+		unsigned int sequence = *(volatile unsigned int*) &ring->not_empty.sequence;
+
+		__sync_fetch_and_add(&ring->not_empty.waiters, 1);
+		if(ring_try_pop(ring, &item)){
+			break;
+		}
+		syscall(__NR_cs1550_wait, &ring->not_empty.sequence, sequence, NULL);
+	}
+
+	ring_signal(&ring->not_full);
+	return item;
+}
@@ -0,0 +1,223 @@
+/*
+ * CS1550 Project 2
+ *
+ * Counting semaphores for processes that share memory.  The value lives in
+ * user memory and up()/down() change it with atomic compare-and-swap, so a
+ * semaphore that nobody is waiting on never enters the kernel.  Only a
+ * down() that finds no resources calls cs1550_wait() to sleep, and only an
+ * up() that sees sleepers calls cs1550_wake(), the same split as the
+ * futex_wait()/futex_wake() pair in kernel/futex.c.  down_n()/up_n() move
+ * n resources with one atomic operation and at most one syscall, and
+ * try_down()/timed_down() let a caller give up instead of blocking.
+ *
+ * These are not interchangeable with the older cs1550_down()/cs1550_up()
+ * and cs1550_down_n()/cs1550_up_n() syscalls: there the kernel owns the
+ * value and lets it go negative.  kernel_down()/kernel_up() at the bottom
+ * wrap those for a struct cs1550_kernel_sem, and rw_down_read() through
+ * rw_up_write() wrap the reader-writer semaphore syscalls.
+ */
+
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define __NR_cs1550_wait 327 //wait() is syscall 327
+#define __NR_cs1550_wake 328 //wake() is syscall 328
+#define __NR_cs1550_down 325 //down() is syscall 325
+#define __NR_cs1550_up 326 //up() is syscall 326
+#define __NR_cs1550_down_n 329 //down_n() is syscall 329
+#define __NR_cs1550_up_n 330 //up_n() is syscall 330
+#define __NR_cs1550_trydown 331 //trydown() is syscall 331
+#define __NR_cs1550_timed_down 332 //timed_down() is syscall 332
+#define __NR_cs1550_rw_down_read 333 //rw_down_read() is syscall 333
+#define __NR_cs1550_rw_down_write 334 //rw_down_write() is syscall 334
+#define __NR_cs1550_rw_up_read 335 //rw_up_read() is syscall 335
+#define __NR_cs1550_rw_up_write 336 //rw_up_write() is syscall 336
+
+struct cs1550_sem{
+	int value; //Resources available; never negative
+	int waiters; //Processes in (or about to enter) cs1550_wait(); up() only calls the kernel when this is nonzero
+	int bulk_waiters; //How many of those want more than one resource
+};
+
+void cs1550_sem_init(struct cs1550_sem* semaphore, int value){
+	semaphore->value = value;
+	semaphore->waiters = 0;
+	semaphore->bulk_waiters = 0;
+}
+
+//Take n resources at once, sleeping until all n are available or, when
+//deadline is not NULL, until CLOCK_MONOTONIC passes it. Returns 1 when the
+//resources were taken and 0 when the deadline passed first.
+int down_until(struct cs1550_sem* semaphore, int n, const struct timespec* deadline){
+	for(;;){
+		int value = *(volatile int*) &semaphore->value;
+		struct timespec remaining;
+
+		if(value >= n){ //Take the resources if nobody beats us to it
+			if(__sync_bool_compare_and_swap(&semaphore->value, value, value - n)){
+				return 1;
+			}
+			continue;
+		}
+
+		if(deadline != NULL){ //The kernel wants the time left, not the deadline
+			clock_gettime(CLOCK_MONOTONIC, &remaining);
+			remaining.tv_sec = deadline->tv_sec - remaining.tv_sec;
+			remaining.tv_nsec = deadline->tv_nsec - remaining.tv_nsec;
+			if(remaining.tv_nsec < 0){
+				remaining.tv_sec--;
+				remaining.tv_nsec += 1000000000;
+			}
+			if(remaining.tv_sec < 0){
+				return 0;
+			}
+		}
+
+		//Announce ourselves before sleeping so up_n() knows to wake us. The
+		//kernel only puts us to sleep if the value has not changed when it
+		//looks, under the same lock cs1550_wake() takes, so an up_n() that
+		//lands in between makes cs1550_wait() return at once instead.
+		__sync_fetch_and_add(&semaphore->waiters, 1);
+		if(n > 1){
+			__sync_fetch_and_add(&semaphore->bulk_waiters, 1);
+		}
+		syscall(__NR_cs1550_wait, &semaphore->value, value, deadline != NULL ? &remaining : NULL);
+		if(n > 1){
+			__sync_fetch_and_sub(&semaphore->bulk_waiters, 1);
+		}
+		__sync_fetch_and_sub(&semaphore->waiters, 1);
+	}
+}
+
+//Take n resources at once, sleeping until all n are available
+void down_n(struct cs1550_sem* semaphore, int n){
+	down_until(semaphore, n, NULL);
+}
+
+//Return n resources at once
+void up_n(struct cs1550_sem* semaphore, int n){
+	__sync_fetch_and_add(&semaphore->value, n); //A full barrier, so the reads of the counts below cannot move ahead of it
+
+	if(*(volatile int*) &semaphore->waiters > 0){
+		//Waking n sleepers is enough when each wants one. When some want
+		//more, the ones woken might not be the ones that can proceed, so
+		//everybody wakes and checks.
+		int wake = *(volatile int*) &semaphore->bulk_waiters > 0 ? INT_MAX : n;
+
+		syscall(__NR_cs1550_wake, &semaphore->value, wake);
+	}
+}
+
+void down(struct cs1550_sem* semaphore){
+	down_n(semaphore, 1);
+}
+
+void up(struct cs1550_sem* semaphore){
+	up_n(semaphore, 1);
+}
+
+//down() that never sleeps: returns 1 if it took a resource, 0 if none was free
+int try_down(struct cs1550_sem* semaphore){
+	int value;
+
+	while((value = *(volatile int*) &semaphore->value) > 0){
+		if(__sync_bool_compare_and_swap(&semaphore->value, value, value - 1)){
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+//down() that gives up after timeout: returns 1 if it took a resource, 0 if the time ran out
+int timed_down(struct cs1550_sem* semaphore, const struct timespec* timeout){
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout->tv_sec;
+	deadline.tv_nsec += timeout->tv_nsec;
+	if(deadline.tv_nsec >= 1000000000){
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	return down_until(semaphore, 1, &deadline);
+}
+
+#define CS1550_SEM_PRIO 1 //Kernel semaphore flag: serve sleepers by task priority, then oldest first
+#define CS1550_SEM_WAKE_AFFINE 2 //Kernel semaphore flag: prefer waking a sleeper on the waking CPU, and count wakeups
+#define CS1550_SEM_MUTEX 4 //Kernel semaphore flag: used as a mutex, so contended downs may spin on the holder
+
+//Semaphore whose value the kernel keeps, for the cs1550_down()/cs1550_up()
+//syscalls. Every down() and up() enters the kernel, which can spin on a
+//running owner before putting a down() to sleep.
+struct cs1550_kernel_sem{
+	int value; //Resources available; negative when processes are asleep waiting
+	int flags; //CS1550_SEM_* options; 0 for a plain FIFO semaphore
+	unsigned int wakeups;
+	unsigned int local_wakeups;
+	unsigned int affine_wakeups;
+};
+
+void cs1550_kernel_sem_init(struct cs1550_kernel_sem* semaphore, int value){
+	memset(semaphore, 0, sizeof(*semaphore));
+	semaphore->value = value;
+}
+
+void kernel_down(struct cs1550_kernel_sem* semaphore){
+	syscall(__NR_cs1550_down, semaphore);
+}
+
+void kernel_up(struct cs1550_kernel_sem* semaphore){
+	syscall(__NR_cs1550_up, semaphore);
+}
+
+//Take n resources at once; sleepers are served in order and keep what they are handed while waiting for the rest
+void kernel_down_n(struct cs1550_kernel_sem* semaphore, int n){
+	syscall(__NR_cs1550_down_n, semaphore, n);
+}
+
+void kernel_up_n(struct cs1550_kernel_sem* semaphore, int n){
+	syscall(__NR_cs1550_up_n, semaphore, n);
+}
+
+//kernel_down() that never sleeps: returns 1 if it took a resource, 0 if none was free
+int kernel_try_down(struct cs1550_kernel_sem* semaphore){
+	return syscall(__NR_cs1550_trydown, semaphore) == 0;
+}
+
+//kernel_down() that gives up after timeout, measured on CLOCK_MONOTONIC: returns 1 if it
+//took a resource, 0 if the time ran out or a signal arrived first
+int kernel_timed_down(struct cs1550_kernel_sem* semaphore, const struct timespec* timeout){
+	return syscall(__NR_cs1550_timed_down, semaphore, timeout) == 0;
+}
+
+//Reader-writer semaphore: any number of readers at once, or one writer.
+//Readers that find it free for reading take it without waiting on each
+//other; once a writer is waiting, new readers wait behind it. The kernel
+//only sleeps and wakes processes when they have to wait.
+struct cs1550_rwsem{
+	int state; //Owned by the kernel's syscalls; 0 when nobody holds it
+};
+
+void cs1550_rwsem_init(struct cs1550_rwsem* semaphore){
+	semaphore->state = 0;
+}
+
+void rw_down_read(struct cs1550_rwsem* semaphore){
+	syscall(__NR_cs1550_rw_down_read, semaphore);
+}
+
+void rw_down_write(struct cs1550_rwsem* semaphore){
+	syscall(__NR_cs1550_rw_down_write, semaphore);
+}
+
+void rw_up_read(struct cs1550_rwsem* semaphore){
+	syscall(__NR_cs1550_rw_up_read, semaphore);
+}
+
+void rw_up_write(struct cs1550_rwsem* semaphore){
+	syscall(__NR_cs1550_rw_up_write, semaphore);
+}
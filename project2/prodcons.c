@@ -11,47 +11,191 @@
  * 	3) The size of buffer to use
  * in that order.  Then, the program produces sequential integers, which
  * are consumed.  The program runs without deadlock and in an infinite loop.
+ *
+ * Options, given before the 3 arguments:
+ * 	-b batch	Move items in blocks of this many, with one down_n()/up_n()
+ * 			on empty and full and one trip through the mutex per block
+ * 	-k		Use semaphores the kernel keeps instead of the userspace
+ * 			ones: cs1550_down()/cs1550_up() on the mutex, whose
+ * 			contended downs spin on the holder as /proc/cs1550_spin
+ * 			allows, and cs1550_down_n()/cs1550_up_n() on empty and full
+ * 	-n items	Each producer stops after this many items (a multiple of
+ * 			the batch); the program then reports items per second
+ * 	-q		Do not print every item
+ * 	-r		Pass items through the lock-free ring in cs1550_ring.c
+ * 			instead of the buffer guarded by semaphores
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
 
 #define TRUE 1
-#define __NR_cs1550_down 325 //down() is syscall 325
-#define __NR_cs1550_up 326 //up() is syscall 326
 
-struct cs1550_sem{
-	int value;
-	struct node* head; //Process queue -- Linked list is 0(1) removal and add with head and tail nodes
-	struct node* tail; //Tail node for the process queue linked list
-};
+#include "cs1550_sem.c" //up(), down(), up_n(), down_n() and struct cs1550_sem
+#include "cs1550_ring.c" //ring_push(), ring_pop() and struct cs1550_ring
+
+#define RING_DONE -1 //Tells a ring consumer the producers have finished
 
-void up(struct cs1550_sem* semaphore){
-	syscall(__NR_cs1550_up, semaphore);
+//Take n resources from semaphore, or with -k from its kernel counterpart kernel_semaphore
+void take(struct cs1550_sem* semaphore, struct cs1550_kernel_sem* kernel_semaphore, int n){
+	if(kernel_semaphore == NULL){
+		down_n(semaphore, n);
+	} else if(n == 1){
+		kernel_down(kernel_semaphore);
+	} else{
+		kernel_down_n(kernel_semaphore, n);
+	}
 }
 
-void down(struct cs1550_sem* semaphore){
-	syscall(__NR_cs1550_down, semaphore);
+//Return n resources to semaphore, or with -k to kernel_semaphore
+void give(struct cs1550_sem* semaphore, struct cs1550_kernel_sem* kernel_semaphore, int n){
+	if(kernel_semaphore == NULL){
+		up_n(semaphore, n);
+	} else if(n == 1){
+		kernel_up(kernel_semaphore);
+	} else{
+		kernel_up_n(kernel_semaphore, n);
+	}
+}
+
+//Seconds elapsed on the monotonic clock since start
+double seconds_since(const struct timespec* start){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+//The -r mode: producers and consumers share a lock-free ring. Producer i
+//makes the items i, i + producers, i + 2*producers, ... so every item is
+//distinct without a shared counter. With -n the parent waits for the
+//producers, then pushes one RING_DONE per consumer.
+int run_ring(int consumers, int producers, int size_of_buffer, int items, int quiet){
+	struct cs1550_ring* ring = cs1550_ring_create(size_of_buffer);
+	pid_t* producer_pids = (pid_t*) malloc(producers*sizeof(pid_t));
+	struct timespec start;
+	int i;
+
+	if(ring == NULL || producer_pids == NULL){
+		printf("Could not allocate the ring.\n");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(i = 0; i < producers; i++){ //Create the producers
+		producer_pids[i] = fork();
+		if(producer_pids[i] == 0){
+			int item;
+			for(item = i; items == 0 || item < items*producers; item += producers){
+				ring_push(ring, item);
+				if(!quiet){
+					printf("Producer %c produced: %d\n", (i+65), item);
+				}
+			}
+			exit(0);
+		}
+	}
+
+	for(i = 0; i < consumers; i++){ //Create the consumers
+		if(fork() == 0){
+			int item;
+			while((item = ring_pop(ring)) != RING_DONE){
+				if(!quiet){
+					printf("Consumer %c consumed: %d\n", (i+65), item);
+				}
+			}
+			exit(0);
+		}
+	}
+
+	//Parent is sitting here as the children continue their IPC; with -n the producers finish
+	int status;
+	for(i = 0; i < producers; i++){
+		waitpid(producer_pids[i], &status, 0);
+	}
+	for(i = 0; i < consumers; i++){
+		ring_push(ring, RING_DONE);
+	}
+	while(wait(&status) > 0);
+
+	double seconds = seconds_since(&start);
+	printf("%d producers, %d consumers, ring %d: %d items in %.3f s, %.0f items/s\n",
+		producers, consumers, ring->mask + 1, items*producers, seconds, items*producers / seconds);
+
+	return 0;
 }
 
 int main(int argc, char* argv[]){
 	int producers = 0;
 	int consumers = 0;
 	int size_of_buffer = 0;
+	int batch = 1;
+	int items = 0; //Items per producer; 0 runs forever
+	int quiet = 0;
+	int use_ring = 0;
+	int use_kernel_sems = 0;
+	int option;
 
-	if(argc != 4){ //Four arguments: executable (# of consumers) (# of producers) (size of buffer)
+	while((option = getopt(argc, argv, "b:kn:qr")) != -1){
+		switch(option){
+			case 'b':
+				batch = strtol(optarg, NULL, 10);
+				break;
+			case 'k':
+				use_kernel_sems = 1;
+				break;
+			case 'n':
+				items = strtol(optarg, NULL, 10);
+				break;
+			case 'q':
+				quiet = 1;
+				break;
+			case 'r':
+				use_ring = 1;
+				break;
+			default:
+				printf("Usage: %s [-b batch] [-k] [-n items] [-q] [-r] consumers producers buffer_size\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if(argc - optind != 3){ //Three arguments: (# of consumers) (# of producers) (size of buffer)
 		printf("Illegal number of arguments; 3 is required!\n");
 		return 1;
 	} else{ //Parse the command-line arguments and make sure they're valid
-		consumers = strtol(argv[1], NULL, 10);
-		producers = strtol(argv[2], NULL, 10);
-		size_of_buffer = strtol(argv[3], NULL, 10);
+		consumers = strtol(argv[optind], NULL, 10);
+		producers = strtol(argv[optind + 1], NULL, 10);
+		size_of_buffer = strtol(argv[optind + 2], NULL, 10);
 
 		if(consumers == 0 || producers == 0 || size_of_buffer == 0){
 			printf("One of the arguments is the value 0; ILLEGAL.\n");
 			return 1;
 		}
+		if(batch <= 0 || batch > size_of_buffer){
+			printf("The batch must be between 1 and the size of the buffer.\n");
+			return 1;
+		}
+		if(use_ring && batch != 1){
+			printf("The ring moves one item at a time; -b does not apply.\n");
+			return 1;
+		}
+		if(use_ring && use_kernel_sems){
+			printf("The ring takes no semaphores; -k does not apply.\n");
+			return 1;
+		}
+		if(items < 0 || items % batch != 0){
+			printf("The number of items must be a multiple of the batch.\n");
+			return 1;
+		}
+	}
+
+	if(use_ring){
+		return run_ring(consumers, producers, size_of_buffer, items, quiet);
 	}
 	
 	//Reserved space for the semaphores to store their data, which is shared between the producers and consumers
@@ -59,7 +203,7 @@ int main(int argc, char* argv[]){
 
 	//Shared variable data for the producers and consumers; includes the buffer, 'in' and 'out' counters (from Misurda's slides)
 	//mmap() allows for inter-process communication (IPC) between the producers and consumers
-	int* shared_memory = (int*) mmap(NULL, (size_of_buffer+2)*sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, 0, 0);
+	int* shared_memory = (int*) mmap(NULL, (size_of_buffer+3)*sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, 0, 0);
 
 	//Later on, helps keep track of positions in the buffer for the producers and consumers respectively
 	int curr_producers = 0;
@@ -68,21 +212,28 @@ int main(int argc, char* argv[]){
 	//full semaphore; the number of resources used
 	struct cs1550_sem* full;
 	full = semaphore_memory + 1; //The 2nd semaphore mapped in memory
-	full->value = 0; //0 resources used thus far
-	full->head = NULL;
-	full->tail = NULL;
+	cs1550_sem_init(full, 0); //0 resources used thus far
 	//empty semaphore; the number of resources available
 	struct cs1550_sem* empty;
 	empty = semaphore_memory; //The 1st semaphore mapped in memory
-	empty->value = size_of_buffer; //We have N, or size_of_buffer, resources available
-	full->head = NULL;
-	full->tail = NULL;
+	cs1550_sem_init(empty, size_of_buffer); //We have N, or size_of_buffer, resources available
 	//mutex semaphore; a lock on the critical regions
 	struct cs1550_sem* mutex;
 	mutex = semaphore_memory + 2; //The 3nd semaphore mapped in memory
-	mutex->value = 1; //Initially set to unlock
-	mutex->head = NULL;
-	mutex->tail = NULL;
+	cs1550_sem_init(mutex, 1); //Initially set to unlock
+	//With -k, the same three semaphores kept by the kernel instead
+	struct cs1550_kernel_sem* kernel_empty = NULL;
+	struct cs1550_kernel_sem* kernel_full = NULL;
+	struct cs1550_kernel_sem* kernel_mutex = NULL;
+	if(use_kernel_sems){
+		kernel_empty = (struct cs1550_kernel_sem*) mmap(NULL, sizeof(struct cs1550_kernel_sem)*3, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, 0, 0);
+		kernel_full = kernel_empty + 1;
+		kernel_mutex = kernel_empty + 2;
+		cs1550_kernel_sem_init(kernel_empty, size_of_buffer);
+		cs1550_kernel_sem_init(kernel_full, 0);
+		cs1550_kernel_sem_init(kernel_mutex, 1);
+		kernel_mutex->flags = CS1550_SEM_MUTEX; //Only the mutex has an owner worth spinning on
+	}
 
 	//Similar to the 'in' variable in Misurda's slides
 	int* curr_produced = shared_memory;
@@ -90,8 +241,12 @@ int main(int argc, char* argv[]){
 	//Similar to the 'out' variable in Misurda's slides
 	int* curr_consumed = shared_memory + 1;
 	*curr_consumed = 0;
+	//Blocks the consumers have claimed, so they know when to stop in -n mode
+	int* blocks_claimed = shared_memory + 2;
+	*blocks_claimed = 0;
+	int total_blocks = producers * (items / batch);
 	//Beginning of the buffer shared between processes in memory
-	int* buffer_ptr = shared_memory + 2;	
+	int* buffer_ptr = shared_memory + 3;
 
 	//For the following two loops, fork() the parent until the necessary
 	//producers and consumers are generated.  This one parent process
@@ -99,42 +254,65 @@ int main(int argc, char* argv[]){
 	//exit from the for loops and wait(), which allows the user to 
 	//Ctrl+C out of the program; without the wait(), it would not be possible.
 
-	int i;	
+	int i;
+	int j;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	for(i = 0; i < producers; i++){ //Create the producers
 		if(fork() == 0){
 			int item;
-			while(TRUE){ //Nearly identical to Misurda's slides
-				down(empty);
-				down(mutex);
-				item = *curr_produced;
-				buffer_ptr[*curr_produced % size_of_buffer] = item; //Insert the item into the buffer; curr_produced increments forever, so make sure it doesn't escape the bounds of the buffer
-				printf("Producer %c produced: %d\n", (i+65), item);
-				*curr_produced += 1;
-				up(mutex);
-				up(full);
+			int produced = 0;
+			while(items == 0 || produced < items){ //Nearly identical to Misurda's slides, one block of items at a time
+				take(empty, kernel_empty, batch);
+				take(mutex, kernel_mutex, 1);
+				for(j = 0; j < batch; j++){
+					item = *curr_produced;
+					buffer_ptr[*curr_produced % size_of_buffer] = item; //Insert the item into the buffer; curr_produced increments forever, so make sure it doesn't escape the bounds of the buffer
+					if(!quiet){
+						printf("Producer %c produced: %d\n", (i+65), item);
+					}
+					*curr_produced += 1;
+				}
+				give(mutex, kernel_mutex, 1);
+				give(full, kernel_full, batch);
+				produced += batch;
 			}
+			exit(0);
 		}
 	}
 
 	for(i = 0; i < consumers; i++){ //Create the consumers
 		if(fork() == 0){
 			int item;
-			while(TRUE){ //Nearly identical to Misurda's slides
-				down(full);
-				down(mutex);	
-				item = buffer_ptr[*curr_consumed % size_of_buffer]; //Grab the item from the buffer; curr_consumed increments forever, so make sure it doesn't escape the bounds of the buffer
-				printf("Consumer %c consumed: %d\n", (i+65), item);
-				*curr_consumed += 1;
-				up(mutex);
-				up(empty);
+			while(items == 0 || __sync_fetch_and_add(blocks_claimed, 1) < total_blocks){ //Nearly identical to Misurda's slides, one block of items at a time
+				take(full, kernel_full, batch);
+				take(mutex, kernel_mutex, 1);
+				for(j = 0; j < batch; j++){
+					item = buffer_ptr[*curr_consumed % size_of_buffer]; //Grab the item from the buffer; curr_consumed increments forever, so make sure it doesn't escape the bounds of the buffer
+					if(!quiet){
+						printf("Consumer %c consumed: %d\n", (i+65), item);
+					}
+					*curr_consumed += 1;
+				}
+				give(mutex, kernel_mutex, 1);
+				give(empty, kernel_empty, batch);
 			}
+			exit(0);
 		}
 	}
-	
-	//Parent is sitting here as the children continue their IPC	
+
+	//Parent is sitting here as the children continue their IPC; with -n they all finish
 	int status;
-	wait(&status);
+	while(wait(&status) > 0);
+
+	if(items != 0){
+		double seconds = seconds_since(&start);
+
+		printf("%d producers, %d consumers, buffer %d, batch %d, %s semaphores: %d items in %.3f s, %.0f items/s\n",
+			producers, consumers, size_of_buffer, batch, use_kernel_sems ? "kernel" : "user", *curr_consumed, seconds, *curr_consumed / seconds);
+	}
 
 	return 0;
 }
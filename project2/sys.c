@@ -22,6 +22,7 @@
 #include <linux/device.h>
 #include <linux/key.h>
 #include <linux/times.h>
+#include <linux/hrtimer.h>
 #include <linux/posix-timers.h>
 #include <linux/security.h>
 #include <linux/dcookies.h>
@@ -38,10 +39,20 @@
 #include <linux/syscalls.h>
 #include <linux/kprobes.h>
 #include <linux/user_namespace.h>
+#include <linux/futex.h>
+#include <linux/jhash.h>
+#include <linux/pagemap.h>
+#include <linux/plist.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/sort.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
 
 #include <asm/uaccess.h>
 #include <asm/io.h>
 #include <asm/unistd.h>
+#include <asm/futex.h>
 
 #ifndef SET_UNALIGN_CTL
 # define SET_UNALIGN_CTL(a,b)	(-EINVAL)
@@ -2358,84 +2369,1317 @@ int orderly_poweroff(bool force)
 }
 EXPORT_SYMBOL_GPL(orderly_poweroff);
 
+
 // CS1550 Project 2 ------------------------------------------------------
 
-DEFINE_SPINLOCK(sem_lock); //Create atomicity with a spin lock
+//Every semaphore gets its own kernel object with its own lock and process
+//queue, so producers and consumers working on different semaphores never
+//touch the same lock. The object is found by hashing the semaphore's user
+//address the way kernel/futex.c does: get_futex_key() turns the address
+//into (inode, page, offset) for shared memory or (mm, address) for private
+//memory, so processes that mapped the same semaphore find the same object.
+//The semaphore's value stays in user memory. cs1550_wait() and
+//cs1550_wake() expose the same queues as a futex-like wait on any int.
+
+#define CS1550_HASHBITS 8 //256 buckets, as futex.c uses
+#define CS1550_IDLE_PER_BUCKET 4 //Unused objects each bucket keeps so the next down()/up() does not allocate
+
+#define CS1550_SEM_PRIO 1 //Serve sleepers by task priority (then oldest first) instead of only oldest first
+#define CS1550_SEM_WAKE_AFFINE 2 //Prefer waking a sleeper that last ran on the waking CPU, and count wakeups
+#define CS1550_SEM_MUTEX 4 //Used as a mutex (value 1, and whoever downs it ups it), so contended downs may spin on the owner
+#define CS1550_AFFINE_SCAN 4 //How many of the oldest sleepers the affine hint looks at
+#define CS1550_FIFO_PRIO MAX_PRIO //Every sleeper gets this priority without CS1550_SEM_PRIO, so the queue is FIFO
+#define CS1550_HIST_BUCKETS 24 //Wait-time histogram: bucket i counts waits of [2^(i-1), 2^i) units of 1024 ns
+#define CS1550_SPIN_NS 20000 //Default for how long a down() spins on a running owner before sleeping; set in /proc/cs1550_spin
+
+//Counting semaphore struct for CS1550 Project 2. Everything past value is
+//optional: zero it and the semaphore is strictly FIFO and keeps no counts.
+struct cs1550_sem{
+	int value; //Value contained within the counting semaphore
+	int flags; //CS1550_SEM_* options, read by every down() and up()
+	unsigned int wakeups; //Sleepers woken by up(); counted with CS1550_SEM_WAKE_AFFINE
+	unsigned int local_wakeups; //Of those, how many last ran on the waking CPU, so woke with a warm cache
+	unsigned int affine_wakeups; //Of those, how many the hint chose over an older sleeper on another CPU: migrations saved
+};
 
-//Node struct to later implement a linked list as a process queue in our semaphore (CS1550 Project 2)
+//Contention counters, kept per semaphore (under its lock) and per CPU (for
+//the totals) so recording them never bounces a shared cache line. Read
+//through /proc/cs1550_stats.
+struct cs1550_stats{
+	unsigned long downs; //down()s of every kind and cs1550_wait()s; reader-writer fast paths only count per CPU
+	unsigned long blocks; //Of those, how many had to sleep
+	unsigned long aborts; //Sleeps ended by a signal or a timeout instead of a wakeup
+	unsigned long wakeups; //Sleepers woken by up() or cs1550_wake()
+	unsigned int max_queue; //Most processes ever asleep on the semaphore at once
+	u64 wait_ns; //Total time spent asleep
+	unsigned long wait_hist[CS1550_HIST_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct cs1550_stats, cs1550_cpu_stats);
+
+//Bump a counter for a semaphore and for this CPU. Called with the
+//semaphore's lock held, which keeps us on this CPU.
+#define CS1550_COUNT(ksem, field) do{ (ksem)->stats.field++; __get_cpu_var(cs1550_cpu_stats).field++; } while(0)
+
+//Count a down() that succeeded without looking up the semaphore's kernel
+//object (the reader-writer fast path). Only this CPU's totals can see it;
+//looking the object up just to count would make readers share a lock.
+static inline void cs1550_count_fast_down(void){
+	get_cpu_var(cs1550_cpu_stats).downs++;
+	put_cpu_var(cs1550_cpu_stats);
+}
+
+//Kernel side of one semaphore
+struct cs1550_ksem{
+	struct list_head list; //Position in its bucket's chain, least recently used first
+	union futex_key key; //Which semaphore this is; holds a reference on the inode or mm behind it while users > 0
+	unsigned long ino; //The inode's number for a shared key, saved so /proc never follows an idle object's key
+	int users; //down()/up() calls using this object; protected by the bucket lock
+	spinlock_t lock; //Guards waiters and the semaphore's value
+	struct plist_head waiters; //Process queue in priority order, oldest first within a priority
+	int queued; //Processes in waiters
+	struct cs1550_stats stats; //Protected by lock; lost if the object is ever freed
+	struct task_struct* owner; //For CS1550_SEM_MUTEX, the process holding it, pinned with a reference while users > 0; NULL otherwise. Protected by lock
+};
+
+//Node in a semaphore's process queue. It lives on the sleeper's kernel
+//stack, like struct futex_q in futex.c: the sleeper cannot return while the
+//node is queued, and whoever dequeues it does so under the semaphore's lock
+//before waking it, so blocking and waking never allocate.
 struct cs1550_node{
-	struct cs1550_node* next; //Reference to the next node in the doubly linked list
-	struct task_struct* process_info;
+	struct plist_node list; //Linked into the semaphore's waiters until up() hands this process the semaphore
+	struct task_struct* task;
+	int needed; //Resources a down() still lacks; up() hands them out in queue order
 };
 
-//Counting semaphore struct for CS1550 Project 2
-struct cs1550_sem{
-	int value; //Value contained within the counting semaphore
-	struct cs1550_node* head; //Process queue -- head of the linked list, allows for 0(1) remove
-	struct cs1550_node* tail; //Process queue -- tail of the linked list, allows for 0(1) add
+struct cs1550_bucket{
+	spinlock_t lock;
+	struct list_head chain;
+	int idle; //Objects in the chain that nobody is using
 };
 
-//Sempahore down() for CS1550 Project 2
-asmlinkage long sys_cs1550_down(struct cs1550_sem* sem){
-	spin_lock(&sem_lock); //Use a spin lock to enter a critical region
+static struct cs1550_bucket cs1550_buckets[1 << CS1550_HASHBITS];
+static struct kmem_cache* cs1550_ksem_cachep; //Semaphore objects are allocated only on a semaphore's first use
+static int cs1550_spin_ns = CS1550_SPIN_NS; //0 turns adaptive spinning off
 
-	sem->value -= 1; //Decrease the semaphore's value by 1 because we now have 1 less resource
+static int __init cs1550_init(void){
+	int i;
 
-	//When the sempahore's value is less than 0, that means we have ran out
-	//of resources, so block the process.
-	if(sem->value < 0){
-		struct cs1550_node* process = (struct cs1550_node*) kmalloc(sizeof(struct cs1550_node), GFP_ATOMIC); //Allocate memory for a new node with the kernel's version of malloc, kmalloc(); uses the GFP_ATOMIC flag to prevent blocking
-		process->process_info = current; //Use the 'current' global variable to get the process's current info
-		process->next = NULL;
-	
-		if(sem->head == NULL){ //Empty linked list, so initialize it
-			sem->head = process;
-			sem->tail = process;
-		} else{ //Enqueue the process to the end of the doubly linked list
-			sem->tail->next = process;
-			sem->tail = process;
+	for(i = 0; i < (1 << CS1550_HASHBITS); i++){
+		spin_lock_init(&cs1550_buckets[i].lock);
+		INIT_LIST_HEAD(&cs1550_buckets[i].chain);
+		cs1550_buckets[i].idle = 0;
+	}
+	cs1550_ksem_cachep = KMEM_CACHE(cs1550_ksem, SLAB_PANIC);
+
+	return 0;
+}
+__initcall(cs1550_init);
+
+//Bucket a key hashes to (same hash as hash_futex())
+static struct cs1550_bucket* cs1550_hash(union futex_key* key){
+	u32 hash = jhash2((u32*) &key->both.word, (sizeof(key->both.word) + sizeof(key->both.ptr)) / 4, key->both.offset);
+
+	return &cs1550_buckets[hash & ((1 << CS1550_HASHBITS) - 1)];
+}
+
+static inline int cs1550_match_key(union futex_key* key1, union futex_key* key2){
+	return key1->both.word == key2->both.word && key1->both.ptr == key2->both.ptr && key1->both.offset == key2->both.offset;
+}
+
+//Find or create the kernel object for a semaphore and mark it in use.
+//Returns an ERR_PTR() when the address is bad or memory runs out.
+static struct cs1550_ksem* cs1550_get_ksem(int __user* uaddr){
+	struct cs1550_ksem* ksem;
+	struct cs1550_ksem* fresh = NULL;
+	struct cs1550_bucket* bucket;
+	union futex_key key;
+	int err;
+
+	if(!access_ok(VERIFY_WRITE, uaddr, sizeof(*uaddr))){
+		return ERR_PTR(-EFAULT);
+	}
+
+	down_read(&current->mm->mmap_sem); //get_futex_key() needs it, and it keeps the key valid until we hold a reference
+	err = get_futex_key((u32 __user*) uaddr, &current->mm->mmap_sem, &key);
+	if(err){
+		up_read(&current->mm->mmap_sem);
+		return ERR_PTR(err);
+	}
+
+	bucket = cs1550_hash(&key);
+
+	for(;;){
+		spin_lock(&bucket->lock);
+		list_for_each_entry(ksem, &bucket->chain, list){
+			if(cs1550_match_key(&ksem->key, &key)){
+				if(ksem->users++ == 0){ //Idle objects pin nothing; take the key's reference again
+					bucket->idle--;
+					get_futex_key_refs(&key);
+					ksem->ino = (key.both.offset & FUT_OFF_INODE) ? key.shared.inode->i_ino : 0;
+				}
+				list_move_tail(&ksem->list, &bucket->chain);
+				spin_unlock(&bucket->lock);
+				up_read(&current->mm->mmap_sem);
+				if(fresh != NULL){ //Another process created it while we were allocating
+					kmem_cache_free(cs1550_ksem_cachep, fresh);
+				}
+				return ksem;
+			}
 		}
 
-		//Force this process to sleep
-		set_current_state(TASK_INTERRUPTIBLE);
-		spin_unlock(&sem_lock);
-		schedule(); //Find another process to run
+		if(fresh != NULL){ //Still missing, so insert ours
+			get_futex_key_refs(&fresh->key);
+			list_add_tail(&fresh->list, &bucket->chain);
+			spin_unlock(&bucket->lock);
+			up_read(&current->mm->mmap_sem);
+			return fresh;
+		}
+		spin_unlock(&bucket->lock);
+
+		//First use of this semaphore; allocate outside the lock where we are allowed to sleep, then look again
+		fresh = kmem_cache_alloc(cs1550_ksem_cachep, GFP_KERNEL);
+		if(fresh == NULL){
+			up_read(&current->mm->mmap_sem);
+			return ERR_PTR(-ENOMEM);
+		}
+		fresh->key = key;
+		fresh->ino = (key.both.offset & FUT_OFF_INODE) ? key.shared.inode->i_ino : 0; //mmap_sem keeps the inode alive
+		fresh->users = 1;
+		spin_lock_init(&fresh->lock);
+		plist_head_init(&fresh->waiters, &fresh->lock);
+		fresh->queued = 0;
+		memset(&fresh->stats, 0, sizeof(fresh->stats));
+		fresh->owner = NULL;
+	}
+}
+
+//Done with a semaphore's object. Idle objects stay cached in their bucket,
+//but drop their key's reference so a cached object never keeps an inode
+//or mm alive after its users are gone; past CS1550_IDLE_PER_BUCKET the
+//least recently used one is freed. A private key is freed as soon as it is
+//idle: it names its mm only by address, and once the reference is dropped
+//a new mm can be allocated at that address and match the stale object.
+//An idle object also forgets its mutex owner and drops that task's reference.
+static void cs1550_put_ksem(struct cs1550_ksem* ksem){
+	struct cs1550_bucket* bucket = cs1550_hash(&ksem->key);
+	struct cs1550_ksem* victim = NULL;
+	struct task_struct* owner = NULL;
+	union futex_key key = ksem->key; //Our copy: once unlocked, the object may be reused or freed
+	int idle;
+
+	spin_lock(&bucket->lock);
+	idle = --ksem->users == 0;
+	if(idle){ //Nobody is left to spin on the owner, so an idle object pins no task either
+		spin_lock(&ksem->lock);
+		owner = ksem->owner;
+		ksem->owner = NULL;
+		spin_unlock(&ksem->lock);
+	}
+	if(idle && !(key.both.offset & FUT_OFF_INODE)){
+		list_del(&ksem->list);
+		victim = ksem;
+	} else if(idle && ++bucket->idle > CS1550_IDLE_PER_BUCKET){
+		list_for_each_entry(victim, &bucket->chain, list){
+			if(victim->users == 0){
+				break;
+			}
+		}
+		list_del(&victim->list);
+		bucket->idle--;
 	} else{
-		spin_unlock(&sem_lock); //Use a spin unlock to leave a critical region
+		victim = NULL;
+	}
+	spin_unlock(&bucket->lock);
+
+	if(idle){ //A cached object no longer keeps the inode or owner alive; drop_futex_key_refs() may sleep, so it runs after unlocking
+		drop_futex_key_refs(&key);
+		if(owner != NULL){
+			put_task_struct(owner);
+		}
+	}
+	if(victim != NULL){
+		kmem_cache_free(cs1550_ksem_cachep, victim);
+	}
+}
+
+//Add delta to the semaphore's value and store the result in *value. The
+//caller holds the semaphore's lock, so page faults are disabled: a page
+//that is not present makes this return -EFAULT instead of sleeping.
+static int cs1550_add_value_locked(int __user* uaddr, int delta, int* value){
+	int ret;
+
+	pagefault_disable();
+	ret = __get_user(*value, uaddr);
+	if(ret == 0 && delta != 0){
+		*value += delta;
+		ret = __put_user(*value, uaddr);
+	}
+	pagefault_enable();
+
+	return ret;
+}
+
+//Take the semaphore's lock and add delta to its value (delta 0 just reads
+//it). On success the lock is held; on a bad address it is not and -EFAULT
+//is returned.
+static int cs1550_lock_and_add(struct cs1550_ksem* ksem, int __user* uaddr, int delta, int* value){
+	for(;;){
+		spin_lock(&ksem->lock);
+		if(cs1550_add_value_locked(uaddr, delta, value) == 0){
+			return 0;
+		}
+		spin_unlock(&ksem->lock);
+
+		if(fault_in_pages_writeable((char __user*) uaddr, sizeof(*uaddr))){ //Bring the page in and try again
+			return -EFAULT;
+		}
+	}
+}
+
+//Read the semaphore's CS1550_SEM_* flags. Called with the lock held just
+//after its value was touched, so the page is present; a fault reads as no
+//flags.
+static int cs1550_flags_locked(struct cs1550_sem __user* sem){
+	int flags = 0;
+
+	pagefault_disable();
+	if(__get_user(flags, &sem->flags)){
+		flags = 0;
 	}
+	pagefault_enable();
+
+	return flags;
+}
+
+//Count one more sleeper on ksem
+static void cs1550_count_block_locked(struct cs1550_ksem* ksem){
+	struct cs1550_stats* cpu_stats = &__get_cpu_var(cs1550_cpu_stats);
+
+	CS1550_COUNT(ksem, blocks);
+	ksem->queued++;
+	if(ksem->queued > ksem->stats.max_queue){
+		ksem->stats.max_queue = ksem->queued;
+	}
+	if(ksem->queued > cpu_stats->max_queue){
+		cpu_stats->max_queue = ksem->queued;
+	}
+}
+
+//Add a finished sleep that began at start to ksem's wait-time totals
+static void cs1550_count_wait_locked(struct cs1550_ksem* ksem, ktime_t start){
+	struct cs1550_stats* cpu_stats = &__get_cpu_var(cs1550_cpu_stats);
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	int bucket = min_t(int, fls_long((unsigned long) (ns >> 10)), CS1550_HIST_BUCKETS - 1);
+
+	ksem->stats.wait_ns += ns;
+	cpu_stats->wait_ns += ns;
+	ksem->stats.wait_hist[bucket]++;
+	cpu_stats->wait_hist[bucket]++;
+}
+
+//Where the current process queues on a semaphore with these flags: by its
+//priority (real-time and lower nice values first) with CS1550_SEM_PRIO, as
+//futexes queue real-time waiters, otherwise all at one priority, so FIFO.
+static inline int cs1550_queue_prio(int flags){
+	return (flags & CS1550_SEM_PRIO) ? current->normal_prio : CS1550_FIFO_PRIO;
+}
+
+//Queue the current process on ksem at prio (lower goes first, oldest first
+//within a priority) and sleep until cs1550_wake_locked() or
+//cs1550_grant_locked() takes it off the queue (returns 0). A signal
+//(-EINTR) or the expiry of timeout, if there is one (-ETIMEDOUT), ends the
+//sleep first and takes the process off the queue itself. Being woken wins
+//over both. Called and returns with the lock held.
+static int cs1550_sleep_locked(struct cs1550_ksem* ksem, struct cs1550_node* process, struct hrtimer_sleeper* timeout, int prio){
+	ktime_t start = ktime_get();
+	int ret;
+
+	plist_node_init(&process->list, prio);
+#ifdef CONFIG_DEBUG_PI_LIST
+	process->list.plist.lock = &ksem->lock;
+#endif
+	process->task = current;
+	plist_add(&process->list, &ksem->waiters);
+	cs1550_count_block_locked(ksem);
+
+	for(;;){
+		set_current_state(TASK_INTERRUPTIBLE);
+		spin_unlock(&ksem->lock);
+		if(timeout == NULL || timeout->task != NULL){ //An expired timer has already cleared task
+			schedule(); //Find another process to run
+		}
+		spin_lock(&ksem->lock);
+
+		if(plist_node_empty(&process->list)){
+			ret = 0;
+			break;
+		}
+		if(timeout != NULL && timeout->task == NULL){
+			ret = -ETIMEDOUT;
+			break;
+		}
+		if(signal_pending(current)){
+			ret = -EINTR;
+			break;
+		}
+	}
+	__set_current_state(TASK_RUNNING);
+
+	if(ret){
+		plist_del(&process->list, &ksem->waiters);
+		ksem->queued--;
+		CS1550_COUNT(ksem, aborts);
+	}
+	cs1550_count_wait_locked(ksem, start);
+	return ret;
+}
+
+//Start timeout so it fires the relative time at utime from now, the way
+//sys_futex() sets up FUTEX_WAIT's timeout. The caller must hrtimer_cancel()
+//it once started.
+static int cs1550_start_timeout(const struct timespec __user* utime, struct hrtimer_sleeper* timeout){
+	struct timespec ts;
+
+	if(copy_from_user(&ts, utime, sizeof(ts))){
+		return -EFAULT;
+	}
+	if(!timespec_valid(&ts)){
+		return -EINVAL;
+	}
+
+	hrtimer_init(&timeout->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	hrtimer_init_sleeper(timeout, current);
+	timeout->timer.expires = ktime_add(ktime_get(), timespec_to_ktime(ts));
+	hrtimer_start(&timeout->timer, timeout->timer.expires, HRTIMER_MODE_ABS);
 
 	return 0;
 }
 
+//Take a sleeper off ksem's queue and wake it. An empty node tells the
+//sleeper it was woken, not signalled or timed out. Called with the lock held.
+static void cs1550_wake_node_locked(struct cs1550_ksem* ksem, struct cs1550_node* process){
+	plist_del(&process->list, &ksem->waiters);
+	ksem->queued--;
+	CS1550_COUNT(ksem, wakeups);
+	wake_up_process(process->task);
+}
+
+//Wake up to n processes from the front of ksem's queue; returns how many.
+//Called with the lock held.
+static int cs1550_wake_locked(struct cs1550_ksem* ksem, int n){
+	int woken = 0;
+
+	while(woken < n && !plist_head_empty(&ksem->waiters)){
+		cs1550_wake_node_locked(ksem, plist_first_entry(&ksem->waiters, struct cs1550_node, list));
+		woken++;
+	}
+
+	return woken;
+}
+
+//The wake-affine hint: among the first CS1550_AFFINE_SCAN sleepers with the
+//same priority as first, find one that last ran on cpu and that k resources
+//would satisfy. Waking it instead of first keeps its cache warm and spares
+//the scheduler a migration. Returns first when there is none.
+static struct cs1550_node* cs1550_pick_affine(struct cs1550_ksem* ksem, struct cs1550_node* first, int k, int cpu){
+	struct cs1550_node* process;
+	int scanned = 0;
+
+	plist_for_each_entry(process, &ksem->waiters, list){
+		if(scanned++ == CS1550_AFFINE_SCAN || process->list.prio != first->list.prio){
+			break;
+		}
+		if(process->needed <= k && task_cpu(process->task) == cpu){
+			return process;
+		}
+	}
+
+	return first;
+}
+
+//Add one wakeup to the semaphore's counters. Called with the lock held;
+//the counters are best effort, so a fault just loses the update.
+static void cs1550_count_wakeup_locked(struct cs1550_sem __user* sem, int local, int affine){
+	unsigned int count;
+
+	pagefault_disable();
+	if(__get_user(count, &sem->wakeups) == 0){
+		__put_user(count + 1, &sem->wakeups);
+	}
+	if(local && __get_user(count, &sem->local_wakeups) == 0){
+		__put_user(count + 1, &sem->local_wakeups);
+	}
+	if(affine && __get_user(count, &sem->affine_wakeups) == 0){
+		__put_user(count + 1, &sem->affine_wakeups);
+	}
+	pagefault_enable();
+}
+
+//Hand k resources to the processes at the front of ksem's queue, in queue
+//order, waking each one whose request is now complete. A sleeper that
+//wants more than is left keeps what it got and stays at the front, so a
+//large down_n() is not starved by smaller ones behind it. With
+//CS1550_SEM_WAKE_AFFINE in flags, a sleeper on this CPU may go ahead of
+//the front one (see cs1550_pick_affine()), and every wakeup is counted in
+//sem. Called with the lock held; returns how many were woken.
+static int cs1550_grant_locked(struct cs1550_ksem* ksem, int k, struct cs1550_sem __user* sem, int flags){
+	int cpu = smp_processor_id(); //Stable: the spin lock disables preemption
+	int woken = 0;
+
+	while(k > 0 && !plist_head_empty(&ksem->waiters)){
+		struct cs1550_node* next = plist_first_entry(&ksem->waiters, struct cs1550_node, list);
+		int affine = 0;
+		int give;
+
+		if((flags & CS1550_SEM_WAKE_AFFINE) && task_cpu(next->task) != cpu){
+			struct cs1550_node* local = cs1550_pick_affine(ksem, next, k, cpu);
+
+			affine = local != next;
+			next = local;
+		}
+
+		give = min(k, next->needed);
+		next->needed -= give;
+		k -= give;
+		if(next->needed > 0){
+			break;
+		}
+
+		if(flags & CS1550_SEM_WAKE_AFFINE){
+			cs1550_count_wakeup_locked(sem, task_cpu(next->task) == cpu, affine);
+		}
+		cs1550_wake_node_locked(ksem, next);
+		woken++;
+	}
+
+	return woken;
+}
+
+//Undo a down of n that did not complete: add the n back and pass on the
+//held resources it had already been given to the sleepers behind it.
+//Called with the lock held. Returns -EFAULT, with the n still taken, if
+//the value's page cannot be brought back in.
+static int cs1550_give_back_locked(struct cs1550_ksem* ksem, struct cs1550_sem __user* sem, int n, int held, int flags){
+	int value;
+
+	while(cs1550_add_value_locked(&sem->value, n, &value)){
+		spin_unlock(&ksem->lock);
+		if(fault_in_pages_writeable((char __user*) &sem->value, sizeof(sem->value))){
+			spin_lock(&ksem->lock);
+			return -EFAULT;
+		}
+		spin_lock(&ksem->lock);
+	}
+	cs1550_grant_locked(ksem, held, sem, flags);
+
+	return 0;
+}
+
+//Make task (or nobody, when NULL) the semaphore's owner. The reference we
+//hold keeps the task_struct around for spinners even if the owner exits
+//without an up(). Called with the lock held; dropping the old owner's
+//reference never sleeps.
+static void cs1550_set_owner_locked(struct cs1550_ksem* ksem, struct task_struct* task){
+	if(task != NULL){
+		get_task_struct(task);
+	}
+	if(ksem->owner != NULL){
+		put_task_struct(ksem->owner);
+	}
+	ksem->owner = task;
+}
+
+//Adaptive spinning, as in the -rt adaptive mutexes: a down() of n that
+//finds fewer than n resources on a CS1550_SEM_MUTEX semaphore while its
+//owner is running on another CPU busy-waits for up to cs1550_spin_ns
+//instead of sleeping, since a short critical section ends before two
+//context switches would. Without a recorded owner it does not spin; the
+//owner is forgotten whenever the object goes idle, so only a down() that
+//overlaps other calls on the semaphore finds one. It stops as soon as n
+//resources are free, the owner changes or is switched out, this CPU has
+//something else to run, or sleepers are queued (up() hands them the
+//resources first). No lock is held while spinning, so the owner's up() is
+//not slowed down.
+static void cs1550_spin_on_owner(struct cs1550_ksem* ksem, struct cs1550_sem __user* sem, int n){
+	struct task_struct* owner;
+	int budget = cs1550_spin_ns;
+	s64 end;
+	int value;
+
+	if(budget <= 0 || num_online_cpus() == 1){
+		return;
+	}
+	if(get_user(value, &sem->value) || value < 0 || value >= n){ //Nothing to wait for, or sleepers are ahead of us
+		return;
+	}
+
+	spin_lock(&ksem->lock);
+	owner = ksem->owner;
+	if(owner != NULL){
+		get_task_struct(owner); //Our own reference, so task_curr() stays safe after an up() drops the semaphore's
+	}
+	spin_unlock(&ksem->lock);
+	if(owner == NULL){
+		return;
+	}
+
+	end = ktime_to_ns(ktime_get()) + budget;
+	while(owner != current && ksem->owner == owner && task_curr(owner) && !need_resched()){
+		if(get_user(value, &sem->value) || value < 0 || value >= n){
+			break;
+		}
+		if(ktime_to_ns(ktime_get()) >= end){
+			break;
+		}
+		cpu_relax(); //Also a compiler barrier, so owner and value are read again
+	}
+	put_task_struct(owner);
+}
+
+//Every flavor of down: take n resources, or with try set return -EAGAIN
+//instead of sleeping, or with utime set give up with -ETIMEDOUT after that
+//long. Nothing is taken unless 0 is returned, except that -EFAULT after
+//giving up means the value could not be restored.
+static long cs1550_down_common(struct cs1550_sem __user* sem, int n, int try, const struct timespec __user* utime){
+	struct cs1550_ksem* ksem;
+	struct cs1550_node process;
+	struct hrtimer_sleeper timeout;
+	struct hrtimer_sleeper* to = NULL;
+	long ret = 0;
+	int value;
+
+	if(n <= 0){
+		return -EINVAL;
+	}
+	if(!access_ok(VERIFY_WRITE, sem, sizeof(*sem))){ //The flags and counters are read and written under the lock too
+		return -EFAULT;
+	}
+
+	ksem = cs1550_get_ksem(&sem->value);
+	if(IS_ERR(ksem)){
+		return PTR_ERR(ksem);
+	}
+
+	if(utime != NULL){
+		ret = cs1550_start_timeout(utime, &timeout);
+		if(ret){
+			goto out;
+		}
+		to = &timeout;
+	}
+
+	if(!try){
+		cs1550_spin_on_owner(ksem, sem, n);
+	}
+
+	//Decrease the semaphore's value by n because we now have n less resources
+	ret = cs1550_lock_and_add(ksem, &sem->value, -n, &value);
+	if(ret){
+		goto cancel;
+	}
+	CS1550_COUNT(ksem, downs);
+
+	//When the sempahore's value is less than 0, that means we have ran out
+	//of resources, so block the process. A negative value is the total the
+	//sleepers still lack.
+	if(value < 0){
+		int flags = cs1550_flags_locked(sem);
+
+		process.needed = min(n, -value);
+		if(try){
+			ret = -EAGAIN;
+		} else{
+			ret = cs1550_sleep_locked(ksem, &process, to, cs1550_queue_prio(flags));
+		}
+		if(ret && cs1550_give_back_locked(ksem, sem, n, n - process.needed, flags)){ //Interrupted, timed out or never slept; give back our place and pass on whatever we held
+			ret = -EFAULT; //The n are lost; say so rather than report a clean failure
+		}
+	}
+	if(ret == 0 && (cs1550_flags_locked(sem) & CS1550_SEM_MUTEX)){
+		cs1550_set_owner_locked(ksem, current);
+	}
+	spin_unlock(&ksem->lock);
+
+cancel:
+	if(to != NULL){
+		hrtimer_cancel(&to->timer);
+	}
+out:
+	cs1550_put_ksem(ksem);
+	return ret;
+}
+
+//Take n resources from the semaphore at once, sleeping until all n are
+//available. Sleepers are served in order, and a sleeper keeps resources
+//handed to it while it waits for the rest. Returns -EINTR, with nothing
+//taken, if a signal arrives first.
+asmlinkage long sys_cs1550_down_n(struct cs1550_sem __user* sem, int n){
+	return cs1550_down_common(sem, n, 0, NULL);
+}
+
+//Return n resources to the semaphore at once, waking every sleeper whose
+//request they complete.
+asmlinkage long sys_cs1550_up_n(struct cs1550_sem __user* sem, int n){
+	struct cs1550_ksem* ksem;
+	long ret = 0;
+	int value;
+
+	if(n <= 0){
+		return -EINVAL;
+	}
+	if(!access_ok(VERIFY_WRITE, sem, sizeof(*sem))){ //The flags and counters are read and written under the lock too
+		return -EFAULT;
+	}
+
+	ksem = cs1550_get_ksem(&sem->value);
+	if(IS_ERR(ksem)){
+		return PTR_ERR(ksem);
+	}
+
+	ret = cs1550_lock_and_add(ksem, &sem->value, n, &value); //We now have n more resources available
+	if(ret){
+		goto out;
+	}
+
+	if(value - n < 0){ //Sleepers lacked -(value - n); hand them what we can
+		cs1550_grant_locked(ksem, min(n, n - value), sem, cs1550_flags_locked(sem));
+	}
+	if(ksem->owner != NULL){ //Released, whoever ups it; spinners waiting on the owner stop and take the semaphore
+		cs1550_set_owner_locked(ksem, NULL);
+	}
+	spin_unlock(&ksem->lock);
+
+out:
+	cs1550_put_ksem(ksem);
+	return ret;
+}
+
+//Sempahore down() for CS1550 Project 2
+asmlinkage long sys_cs1550_down(struct cs1550_sem __user* sem){
+	return sys_cs1550_down_n(sem, 1);
+}
+
 //Semaphore up() for CS1550 Project 2
-asmlinkage long sys_cs1550_up(struct cs1550_sem* sem){
-	spin_lock(&sem_lock); //Use a spin lock to enter a critical region
+asmlinkage long sys_cs1550_up(struct cs1550_sem __user* sem){
+	return sys_cs1550_up_n(sem, 1);
+}
+
+//down() that never sleeps: -EAGAIN when no resource is free
+asmlinkage long sys_cs1550_trydown(struct cs1550_sem __user* sem){
+	return cs1550_down_common(sem, 1, 1, NULL);
+}
+
+//down() that gives up with -ETIMEDOUT once the relative timeout has passed
+//(measured on CLOCK_MONOTONIC). A NULL timeout waits forever.
+asmlinkage long sys_cs1550_timed_down(struct cs1550_sem __user* sem, const struct timespec __user* timeout){
+	return cs1550_down_common(sem, 1, 0, timeout);
+}
+
+//Sleep on the word at uaddr if it still holds expected, as FUTEX_WAIT does.
+//This is the slow path of the userspace semaphores in cs1550_sem.c: they
+//change the word with atomic instructions and only call in here to sleep.
+//Comparing under the same lock that cs1550_wake() takes means a wake that
+//follows a change of the word cannot be missed. Returns 0 when woken,
+//-EAGAIN when the word had already changed, -EINTR on a signal and
+//-ETIMEDOUT when the relative timeout runs out (NULL waits forever).
+asmlinkage long sys_cs1550_wait(int __user* uaddr, int expected, const struct timespec __user* utime){
+	struct cs1550_ksem* ksem = cs1550_get_ksem(uaddr);
+	struct cs1550_node process;
+	struct hrtimer_sleeper timeout;
+	struct hrtimer_sleeper* to = NULL;
+	long ret = 0;
+	int value;
+
+	if(IS_ERR(ksem)){
+		return PTR_ERR(ksem);
+	}
+
+	if(utime != NULL){
+		ret = cs1550_start_timeout(utime, &timeout);
+		if(ret){
+			goto out;
+		}
+		to = &timeout;
+	}
+
+	ret = cs1550_lock_and_add(ksem, uaddr, 0, &value);
+	if(ret == 0){
+		CS1550_COUNT(ksem, downs);
+		if(value != expected){
+			ret = -EAGAIN;
+		} else{
+			process.needed = 0; //Holds nothing; a grant that reaches it just wakes it early, which callers allow for
+			ret = cs1550_sleep_locked(ksem, &process, to, CS1550_FIFO_PRIO);
+		}
+		spin_unlock(&ksem->lock);
+	}
+
+	if(to != NULL){
+		hrtimer_cancel(&to->timer);
+	}
+out:
+	cs1550_put_ksem(ksem);
+	return ret;
+}
 
-	sem->value += 1; //We now have 1 more resource available
+//Wake up to n processes sleeping in cs1550_wait() on uaddr, as FUTEX_WAKE
+//does. Returns how many were woken.
+asmlinkage long sys_cs1550_wake(int __user* uaddr, int n){
+	struct cs1550_ksem* ksem = cs1550_get_ksem(uaddr);
+	long ret;
 
-	if(sem->value <= 0){ //Dequeue the next available sleeping process
-		//When waking a process up, grab the head of the linked list and its process info
-		struct cs1550_node* process = sem->head;
-		struct task_struct* process_info;
+	if(IS_ERR(ksem)){
+		return PTR_ERR(ksem);
+	}
 
-		if(process != NULL){
-			//Process info of the process to be awoken
-			process_info = process->process_info;	
+	spin_lock(&ksem->lock);
+	ret = cs1550_wake_locked(ksem, n);
+	spin_unlock(&ksem->lock);
 
-			if(sem->head == sem->tail){ //Only one node left; make the linked list null
-				sem->tail = NULL;
-				sem->head = NULL;
+	cs1550_put_ksem(ksem);
+	return ret;
+}
+
+//Reader-writer semaphores. The whole state is one int in user memory:
+//the number of readers holding it, plus CS1550_RW_WRITER while a writer
+//holds it and CS1550_RW_WAITING while anyone is queued. Taking and
+//releasing it change the int with a compare-and-swap and do not touch the
+//semaphore's kernel object at all unless someone has to sleep or be woken,
+//so concurrent readers never wait on each other or on a lock. Sleepers
+//queue on the same kernel object and queue as cs1550_down() uses, writers
+//ahead of readers: once a writer is waiting, new readers queue behind it
+//(writer preference), and when no writer is left in the queue every
+//queued reader is let in and woken at once.
+
+#define CS1550_RW_WRITER (1 << 29) //A writer holds the semaphore
+#define CS1550_RW_WAITING (1 << 30) //The queue is not empty, so nobody may take the semaphore without looking at it
+#define CS1550_RW_READERS (CS1550_RW_WRITER - 1) //Mask for the number of readers holding the semaphore
+#define CS1550_RW_WRITE_PRIO (CS1550_FIFO_PRIO - 1) //Queued writers sort ahead of queued readers
+#define CS1550_RW_READ_PRIO CS1550_FIFO_PRIO
+
+//Reader-writer semaphore struct for CS1550 Project 2; zero it before use
+struct cs1550_rwsem{
+	int state; //Readers holding it plus the CS1550_RW_* bits; never negative, so it cannot be mistaken for -EFAULT
+};
+
+//Compare-and-swap the int at uaddr from old to new without sleeping, as
+//cmpxchg_futex_value_locked() does. Returns the value found (the swap
+//happened if it equals old), or -EFAULT if the page is not present.
+static int cs1550_cmpxchg(int __user* uaddr, int old, int new){
+	int cur;
+
+	pagefault_disable();
+	cur = futex_atomic_cmpxchg_inatomic(uaddr, old, new);
+	pagefault_enable();
+
+	return cur;
+}
+
+//Hand the semaphore to whoever in ksem's queue can have it, after adding
+//delta to its state (a release, or 0 after a sleeper gave up): the first
+//queued writer once nobody holds it, or, with no writer queued and no
+//writer holding it, every queued reader in one go. The state change and
+//the hand-off are one compare-and-swap, so readers releasing without the
+//lock at the same time are never lost. Returns -EFAULT, with nothing
+//changed, if the page is not present. Called with the lock held.
+static int cs1550_rw_wake_locked(struct cs1550_ksem* ksem, int __user* uaddr, int delta){
+	struct cs1550_node* first = NULL;
+	int found;
+	int cur;
+	int state;
+
+	if(!plist_head_empty(&ksem->waiters)){
+		first = plist_first_entry(&ksem->waiters, struct cs1550_node, list);
+	}
+
+	pagefault_disable();
+	if(__get_user(cur, uaddr)){
+		cur = -EFAULT;
+	}
+	pagefault_enable();
+
+	while(cur != -EFAULT){
+		int granted = 0;
+
+		state = cur + delta;
+		if(first == NULL){
+			state &= ~CS1550_RW_WAITING;
+		} else if(first->list.prio == CS1550_RW_WRITE_PRIO){
+			granted = !(state & (CS1550_RW_WRITER | CS1550_RW_READERS));
+			if(granted){
+				state |= CS1550_RW_WRITER;
+			}
+			if(!granted || ksem->queued > 1){
+				state |= CS1550_RW_WAITING;
+			} else{
+				state &= ~CS1550_RW_WAITING;
+			}
+		} else{ //Only readers are queued, since writers sort first
+			granted = !(state & CS1550_RW_WRITER);
+			if(granted){
+				state = (state + ksem->queued) & ~CS1550_RW_WAITING;
 			} else{
-				sem->head = process->next;
+				state |= CS1550_RW_WAITING;
+			}
+		}
+
+		found = cs1550_cmpxchg(uaddr, cur, state);
+		if(found == cur){
+			if(granted && first->list.prio == CS1550_RW_WRITE_PRIO){
+				cs1550_wake_node_locked(ksem, first);
+			} else if(granted){
+				cs1550_wake_locked(ksem, ksem->queued); //The batch: every reader, with one pass over the queue
+			}
+			return 0;
+		}
+		cur = found; //A reader released meanwhile; decide again
+	}
+
+	return -EFAULT;
+}
+
+//cs1550_rw_wake_locked(), bringing the page in and trying again when it
+//is not present. Called and returns with the lock held.
+static int cs1550_rw_release_locked(struct cs1550_ksem* ksem, int __user* uaddr, int delta){
+	while(cs1550_rw_wake_locked(ksem, uaddr, delta)){
+		spin_unlock(&ksem->lock);
+		if(fault_in_pages_writeable((char __user*) uaddr, sizeof(*uaddr))){
+			spin_lock(&ksem->lock);
+			return -EFAULT;
+		}
+		spin_lock(&ksem->lock);
+	}
+
+	return 0;
+}
+
+//Whether a reader (or, with write set, a writer) may take the semaphore
+//in this state right now
+static inline int cs1550_rw_free(int state, int write){
+	if(write){
+		return state == 0;
+	}
+	return !(state & (CS1550_RW_WRITER | CS1550_RW_WAITING)); //Readers also stay out while a writer is queued
+}
+
+//Take the semaphore for reading or, with write set, for writing. The fast
+//path is one compare-and-swap; the slow path marks the semaphore waited on,
+//queues and sleeps until a release hands it over. Returns -EINTR, with
+//nothing taken, if a signal arrives first.
+static long cs1550_rw_down(struct cs1550_rwsem __user* sem, int write){
+	int __user* uaddr = &sem->state;
+	struct cs1550_ksem* ksem;
+	struct cs1550_node process;
+	int add = write ? CS1550_RW_WRITER : 1;
+	long ret = 0;
+	int found;
+	int cur;
+
+	if(!access_ok(VERIFY_WRITE, uaddr, sizeof(*uaddr))){
+		return -EFAULT;
+	}
+
+	for(;;){ //Fast path, without the kernel object
+		if(get_user(cur, uaddr)){
+			return -EFAULT;
+		}
+		if(!cs1550_rw_free(cur, write)){
+			break;
+		}
+
+		found = cs1550_cmpxchg(uaddr, cur, cur + add);
+		if(found == cur){
+			cs1550_count_fast_down();
+			return 0;
+		}
+		if(found == -EFAULT && fault_in_pages_writeable((char __user*) uaddr, sizeof(*uaddr))){
+			return -EFAULT;
+		}
+	}
+
+	ksem = cs1550_get_ksem(uaddr);
+	if(IS_ERR(ksem)){
+		return PTR_ERR(ksem);
+	}
+
+	spin_lock(&ksem->lock);
+	CS1550_COUNT(ksem, downs);
+	for(;;){
+		pagefault_disable();
+		if(__get_user(cur, uaddr)){
+			cur = -EFAULT;
+		}
+		pagefault_enable();
+
+		if(cur != -EFAULT){
+			int free = cs1550_rw_free(cur, write);
+			int want = free ? cur + add : cur | CS1550_RW_WAITING; //Take it, or make every release look at the queue
+
+			found = want == cur ? cur : cs1550_cmpxchg(uaddr, cur, want);
+			if(found == cur){
+				if(!free){
+					ret = cs1550_sleep_locked(ksem, &process, NULL, write ? CS1550_RW_WRITE_PRIO : CS1550_RW_READ_PRIO);
+					if(ret){ //Gave up; the processes behind us may be able to go now
+						cs1550_rw_release_locked(ksem, uaddr, 0);
+					}
+				}
+				break;
+			}
+			if(found != -EFAULT){ //Changed under us by a lock-free release
+				continue;
+			}
+		}
+
+		spin_unlock(&ksem->lock);
+		if(fault_in_pages_writeable((char __user*) uaddr, sizeof(*uaddr))){
+			ret = -EFAULT;
+			goto out;
+		}
+		spin_lock(&ksem->lock);
+	}
+	spin_unlock(&ksem->lock);
+
+out:
+	cs1550_put_ksem(ksem);
+	return ret;
+}
+
+//Release the semaphore held for reading or, with write set, for writing.
+//Without sleepers this is one compare-and-swap; the last reader out, or a
+//writer, that finds CS1550_RW_WAITING hands it on under the lock instead.
+static long cs1550_rw_up(struct cs1550_rwsem __user* sem, int write){
+	int __user* uaddr = &sem->state;
+	struct cs1550_ksem* ksem;
+	int sub = write ? CS1550_RW_WRITER : 1;
+	long ret;
+	int found;
+	int cur;
+
+	if(!access_ok(VERIFY_WRITE, uaddr, sizeof(*uaddr))){
+		return -EFAULT;
+	}
+
+	for(;;){ //Fast path, unless we may be the one who has to wake someone
+		if(get_user(cur, uaddr)){
+			return -EFAULT;
+		}
+		if(write ? !(cur & CS1550_RW_WRITER) : ((cur & CS1550_RW_WRITER) || !(cur & CS1550_RW_READERS))){
+			return -EINVAL; //Not held that way
+		}
+		if((cur & CS1550_RW_WAITING) && (write || (cur & CS1550_RW_READERS) == 1)){
+			break;
+		}
+
+		found = cs1550_cmpxchg(uaddr, cur, cur - sub);
+		if(found == cur){
+			return 0;
+		}
+		if(found == -EFAULT && fault_in_pages_writeable((char __user*) uaddr, sizeof(*uaddr))){
+			return -EFAULT;
+		}
+	}
+
+	ksem = cs1550_get_ksem(uaddr);
+	if(IS_ERR(ksem)){
+		return PTR_ERR(ksem);
+	}
+
+	spin_lock(&ksem->lock);
+	ret = cs1550_rw_release_locked(ksem, uaddr, -sub);
+	spin_unlock(&ksem->lock);
+
+	cs1550_put_ksem(ksem);
+	return ret;
+}
+
+//Reader-writer semaphore down_read() for CS1550 Project 2
+asmlinkage long sys_cs1550_rw_down_read(struct cs1550_rwsem __user* sem){
+	return cs1550_rw_down(sem, 0);
+}
+
+//Reader-writer semaphore down_write() for CS1550 Project 2
+asmlinkage long sys_cs1550_rw_down_write(struct cs1550_rwsem __user* sem){
+	return cs1550_rw_down(sem, 1);
+}
+
+//Reader-writer semaphore up_read() for CS1550 Project 2
+asmlinkage long sys_cs1550_rw_up_read(struct cs1550_rwsem __user* sem){
+	return cs1550_rw_up(sem, 0);
+}
+
+//Reader-writer semaphore up_write() for CS1550 Project 2
+asmlinkage long sys_cs1550_rw_up_write(struct cs1550_rwsem __user* sem){
+	return cs1550_rw_up(sem, 1);
+}
+
+//The /proc/cs1550_stats file, in the style of lock_stat in
+//kernel/lockdep_proc.c: totals and a wait-time histogram summed over the
+//CPUs, then one line per semaphore the kernel currently tracks, most
+//blocked first. Writing 0 to the file clears every counter.
+
+struct cs1550_stat_data{
+	char name[40]; //Which semaphore, in terms of its key
+	int queued;
+	struct cs1550_stats stats;
+};
+
+struct cs1550_stat_seq{
+	struct cs1550_stat_data* end;
+	struct cs1550_stat_data data[0];
+};
+
+//Sort the most blocked semaphores first
+static int cs1550_stat_cmp(const void* l, const void* r){
+	const struct cs1550_stat_data* dl = l;
+	const struct cs1550_stat_data* dr = r;
+
+	return (dr->stats.blocks > dl->stats.blocks) - (dr->stats.blocks < dl->stats.blocks);
+}
+
+static void cs1550_seq_hist(struct seq_file* m, const unsigned long* hist){
+	int i;
+
+	for(i = 0; i < CS1550_HIST_BUCKETS; i++){
+		if(hist[i] != 0){
+			seq_printf(m, " %2d:%lu", i, hist[i]);
+		}
+	}
+	seq_printf(m, "\n");
+}
+
+static void cs1550_seq_header(struct seq_file* m){
+	struct cs1550_stats total;
+	int cpu;
+	int i;
+
+	memset(&total, 0, sizeof(total));
+	for_each_possible_cpu(cpu){
+		struct cs1550_stats* stats = &per_cpu(cs1550_cpu_stats, cpu);
+
+		total.downs += stats->downs;
+		total.blocks += stats->blocks;
+		total.aborts += stats->aborts;
+		total.wakeups += stats->wakeups;
+		total.max_queue = max(total.max_queue, stats->max_queue);
+		total.wait_ns += stats->wait_ns;
+		for(i = 0; i < CS1550_HIST_BUCKETS; i++){
+			total.wait_hist[i] += stats->wait_hist[i];
+		}
+	}
+
+	seq_printf(m, "cs1550_stats version 0.1\n");
+	seq_printf(m, " downs:                %11lu\n", total.downs);
+	seq_printf(m, " blocks:               %11lu\n", total.blocks);
+	seq_printf(m, " aborted sleeps:       %11lu\n", total.aborts);
+	seq_printf(m, " wakeups:              %11lu\n", total.wakeups);
+	seq_printf(m, " max queue length:     %11u\n", total.max_queue);
+	seq_printf(m, " total wait (1024 ns):  %11llu\n", (unsigned long long) total.wait_ns >> 10);
+	seq_printf(m, " wait histogram (bucket i: [2^(i-1), 2^i) x 1024 ns):");
+	cs1550_seq_hist(m, total.wait_hist);
+	seq_printf(m, "\n%-32s %10s %10s %8s %10s %6s %6s  %s\n", "semaphore", "downs", "blocks", "aborts", "wakeups", "queued", "max", "wait histogram");
+}
+
+static void* cs1550_stat_start(struct seq_file* m, loff_t* pos){
+	struct cs1550_stat_seq* seq = m->private;
+
+	if(*pos == 0){
+		return SEQ_START_TOKEN;
+	}
+	if(seq->data + *pos - 1 >= seq->end){
+		return NULL;
+	}
+
+	return seq->data + *pos - 1;
+}
+
+static void* cs1550_stat_next(struct seq_file* m, void* v, loff_t* pos){
+	(*pos)++;
+	return cs1550_stat_start(m, pos);
+}
+
+static void cs1550_stat_stop(struct seq_file* m, void* v){
+}
+
+static int cs1550_stat_show(struct seq_file* m, void* v){
+	struct cs1550_stat_data* data = v;
+
+	if(v == SEQ_START_TOKEN){
+		cs1550_seq_header(m);
+		return 0;
+	}
+
+	seq_printf(m, "%-32s %10lu %10lu %8lu %10lu %6d %6u ", data->name, data->stats.downs, data->stats.blocks,
+		data->stats.aborts, data->stats.wakeups, data->queued, data->stats.max_queue);
+	cs1550_seq_hist(m, data->stats.wait_hist);
+
+	return 0;
+}
+
+static const struct seq_operations cs1550_stat_ops = {
+	.start	= cs1550_stat_start,
+	.next	= cs1550_stat_next,
+	.stop	= cs1550_stat_stop,
+	.show	= cs1550_stat_show,
+};
+
+//Name a semaphore the way its key does: by shared-memory inode and byte
+//offset, or by process address space and address. Called while the key
+//still pins the inode.
+static void cs1550_stat_name(char* name, size_t size, struct cs1550_ksem* ksem){
+	union futex_key* key = &ksem->key;
+	int offset = key->both.offset & ~(FUT_OFF_INODE | FUT_OFF_MMSHARED);
+
+	if(key->both.offset & FUT_OFF_INODE){ //Only the saved number: an idle object's inode may be gone
+		snprintf(name, size, "inode %lu+%#lx", ksem->ino, (key->shared.pgoff << PAGE_SHIFT) + offset);
+	} else{
+		snprintf(name, size, "mm %p %#lx", key->private.mm, key->private.address + offset);
+	}
+}
+
+//Snapshot every tracked semaphore's counters, so the file reads without
+//holding any lock
+static int cs1550_stat_open(struct inode* inode, struct file* file){
+	struct cs1550_stat_seq* seq;
+	struct cs1550_stat_data* data;
+	struct cs1550_ksem* ksem;
+	int count = 0;
+	int res;
+	int i;
+
+	for(i = 0; i < (1 << CS1550_HASHBITS); i++){
+		spin_lock(&cs1550_buckets[i].lock);
+		list_for_each_entry(ksem, &cs1550_buckets[i].chain, list){
+			count++;
+		}
+		spin_unlock(&cs1550_buckets[i].lock);
+	}
+
+	count += 64; //Room for semaphores first used while we copy
+	seq = vmalloc(sizeof(struct cs1550_stat_seq) + count*sizeof(struct cs1550_stat_data));
+	if(!seq){
+		return -ENOMEM;
+	}
+
+	data = seq->data;
+	for(i = 0; i < (1 << CS1550_HASHBITS); i++){
+		spin_lock(&cs1550_buckets[i].lock);
+		list_for_each_entry(ksem, &cs1550_buckets[i].chain, list){
+			if(data == seq->data + count){
+				break;
 			}
+			spin_lock(&ksem->lock);
+			cs1550_stat_name(data->name, sizeof(data->name), ksem);
+			data->queued = ksem->queued;
+			data->stats = ksem->stats;
+			spin_unlock(&ksem->lock);
+			data++;
+		}
+		spin_unlock(&cs1550_buckets[i].lock);
+	}
+	seq->end = data;
+	sort(seq->data, seq->end - seq->data, sizeof(struct cs1550_stat_data), cs1550_stat_cmp, NULL);
+
+	res = seq_open(file, &cs1550_stat_ops);
+	if(res){
+		vfree(seq);
+		return res;
+	}
+	((struct seq_file*) file->private_data)->private = seq;
+
+	return 0;
+}
+
+static ssize_t cs1550_stat_write(struct file* file, const char __user* buf, size_t count, loff_t* ppos){
+	struct cs1550_ksem* ksem;
+	int cpu;
+	int i;
+	char c;
+
+	if(count){
+		if(get_user(c, buf)){
+			return -EFAULT;
+		}
+		if(c != '0'){
+			return count;
+		}
 
-			wake_up_process(process_info);
+		for(i = 0; i < (1 << CS1550_HASHBITS); i++){
+			spin_lock(&cs1550_buckets[i].lock);
+			list_for_each_entry(ksem, &cs1550_buckets[i].chain, list){
+				spin_lock(&ksem->lock);
+				memset(&ksem->stats, 0, sizeof(ksem->stats));
+				spin_unlock(&ksem->lock);
+			}
+			spin_unlock(&cs1550_buckets[i].lock);
+		}
+		for_each_possible_cpu(cpu){ //Racy against CPUs counting right now, as clear_lock_stats() is
+			memset(&per_cpu(cs1550_cpu_stats, cpu), 0, sizeof(struct cs1550_stats));
 		}
+	}
+
+	return count;
+}
+
+static int cs1550_stat_release(struct inode* inode, struct file* file){
+	struct seq_file* seq = file->private_data;
+
+	vfree(seq->private);
+	seq->private = NULL;
+	return seq_release(inode, file);
+}
+
+static const struct file_operations proc_cs1550_stat_operations = {
+	.open		= cs1550_stat_open,
+	.write		= cs1550_stat_write,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= cs1550_stat_release,
+};
+
+//Reading /proc/cs1550_spin gives the adaptive spin budget in nanoseconds;
+//writing a number sets it, and 0 turns spinning off.
+static int cs1550_spin_read(char* page, char** start, off_t off, int count, int* eof, void* data){
+	int len = sprintf(page, "%d\n", cs1550_spin_ns);
+
+	*eof = 1;
+	return len;
+}
 
-		kfree(process); //Free this node so no space is being wasted
+static int cs1550_spin_write(struct file* file, const char __user* buffer, unsigned long count, void* data){
+	char buf[16];
+	long budget;
+
+	if(count >= sizeof(buf)){
+		return -EINVAL;
+	}
+	if(copy_from_user(buf, buffer, count)){
+		return -EFAULT;
+	}
+	buf[count] = '\0';
+
+	budget = simple_strtol(buf, NULL, 10);
+	if(budget < 0 || budget > NSEC_PER_SEC){ //Spinning for more than a second is never what anyone wants
+		return -EINVAL;
 	}
+	cs1550_spin_ns = budget;
+
+	return count;
+}
 
-	spin_unlock(&sem_lock); //Use a spin lock to leave a critical region
+static int __init cs1550_proc_init(void){
+	struct proc_dir_entry* entry;
+
+	entry = create_proc_entry("cs1550_stats", S_IRUSR | S_IWUSR, NULL);
+	if(entry){
+		entry->proc_fops = &proc_cs1550_stat_operations;
+	}
+	entry = create_proc_entry("cs1550_spin", S_IRUGO | S_IWUSR, NULL);
+	if(entry){
+		entry->read_proc = cs1550_spin_read;
+		entry->write_proc = cs1550_spin_write;
+	}
 
 	return 0;
 }
+__initcall(cs1550_proc_init);
@@ -332,10 +332,20 @@
 #define __NR_fallocate		324
 #define __NR_sys_cs1550_down    325 //Added for CS1550 Project 2
 #define __NR_sys_cs1550_up	326 //Added for CS1550 Project 2
+#define __NR_sys_cs1550_wait	327 //Added for CS1550 Project 2
+#define __NR_sys_cs1550_wake	328 //Added for CS1550 Project 2
+#define __NR_sys_cs1550_down_n	329 //Added for CS1550 Project 2
+#define __NR_sys_cs1550_up_n	330 //Added for CS1550 Project 2
+#define __NR_sys_cs1550_trydown	331 //Added for CS1550 Project 2
+#define __NR_sys_cs1550_timed_down	332 //Added for CS1550 Project 2
+#define __NR_sys_cs1550_rw_down_read	333 //Added for CS1550 Project 2
+#define __NR_sys_cs1550_rw_down_write	334 //Added for CS1550 Project 2
+#define __NR_sys_cs1550_rw_up_read	335 //Added for CS1550 Project 2
+#define __NR_sys_cs1550_rw_up_write	336 //Added for CS1550 Project 2
 
 #ifdef __KERNEL__
 
-#define NR_syscalls 327
+#define NR_syscalls 337
 
 #define __ARCH_WANT_IPC_PARSE_VERSION
 #define __ARCH_WANT_OLD_READDIR